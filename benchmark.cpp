@@ -0,0 +1,300 @@
+#include "benchmark.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+#include "decodevideo.hpp"
+#include "fastpixelmap.hpp"
+#include "palettesearch.hpp"
+
+using namespace std;
+
+// The check passes while at most 1 pixel in 1000 gets a farther color from MPS than from full search. MPS's early
+// termination misses the true closest color for a few colors by design, a bug in it misses far more.
+const long long MAX_MISMATCHES_PER_THOUSAND = 1;
+
+double timePasses(const function<void()> &pass) {
+    auto start = chrono::steady_clock::now();
+    double seconds = 0;
+    do {
+        pass();
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (seconds < 0.25);
+    return seconds;
+}
+
+static string jsonString(const string &text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+void BenchmarkReport::addResult(const BenchmarkResult &result) {
+    results.push_back(result);
+    cout << result.stage << " " << result.input << " " << result.variant << ": " << result.frames / result.seconds << " frames/s" << endl;
+}
+
+void BenchmarkReport::addCheck(const BenchmarkCheck &check) {
+    checks.push_back(check);
+    cout << check.check << " " << check.input << ": " << (check.passed ? "passed" : "FAILED") << ", " << check.mismatches
+         << " of " << check.pixels << " pixels farther" << endl;
+}
+
+bool BenchmarkReport::allChecksPassed() const {
+    for (auto& check : checks) {
+        if (!check.passed) return false;
+    }
+    return true;
+}
+
+void BenchmarkReport::write(ostream &out) const {
+    out << "{" << endl;
+    out << "  \"width\": " << width << "," << endl;
+    out << "  \"height\": " << height << "," << endl;
+    out << "  \"movie\": " << (movie.empty() ? "null" : jsonString(movie)) << "," << endl;
+    out << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult &result = results[i];
+        out << "    {\"stage\": " << jsonString(result.stage) << ", \"input\": " << jsonString(result.input)
+            << ", \"variant\": " << jsonString(result.variant) << ", \"frames\": " << result.frames
+            << fixed << setprecision(6) << ", \"seconds\": " << result.seconds << setprecision(3)
+            << ", \"nsPerPixel\": " << 1e9 * result.seconds / ((double) result.frames * result.pixelsPerFrame)
+            << ", \"framesPerSecond\": " << result.frames / result.seconds;
+        if (result.bytes > 0) out << ", \"bytesPerFrame\": " << (double) result.bytes / result.frames;
+        out << "}" << (i+1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]," << endl;
+    out << "  \"checks\": [" << endl;
+    for (size_t i = 0; i < checks.size(); i++) {
+        const BenchmarkCheck &check = checks[i];
+        out << "    {\"check\": " << jsonString(check.check) << ", \"input\": " << jsonString(check.input)
+            << ", \"pixels\": " << check.pixels << ", \"ties\": " << check.ties << ", \"mismatches\": " << check.mismatches
+            << ", \"passed\": " << (check.passed ? "true" : "false") << "}" << (i+1 < checks.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl;
+    out << "}" << endl;
+}
+
+// Draws frame of a synthetic BGRA scene: a still gradient with a ball moving across it, so only the pixels around the
+// ball really change
+void drawBenchmarkScene(vector<uint8_t> & image, int width, int height, int frame, int frameCount) {
+    double ballX = width * (0.2 + 0.6 * frame / frameCount);
+    double ballY = height * 0.5;
+    double radius = height * 0.15;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *pixel = &image[4 * (y*width + x)];
+            bool inBall = hypot(x - ballX, y - ballY) < radius;
+            pixel[0] = inBall ? 40 : 255 * y / height;
+            pixel[1] = inBall ? 60 : 128;
+            pixel[2] = inBall ? 220 : 255 * x / width;
+        }
+    }
+}
+
+BenchmarkInput syntheticBenchmarkInput(int width, int height, int frameCount) {
+    BenchmarkInput input = {"synthetic", width, height, {}};
+    for (int frame = 0; frame < frameCount; frame++) {
+        input.frames.emplace_back(4 * width * height);
+        drawBenchmarkScene(input.frames.back(), width, height, frame, frameCount);
+    }
+    return input;
+}
+
+BenchmarkInput movieBenchmarkInput(string movie, int width, int height, int frameRate, int frameCount) {
+    BenchmarkInput input = {"movie", width, height, {}};
+    VideoDecoder decoder(width, height, frameRate, movie);
+    int linesize = (width + (ALIGNMENT-(width%ALIGNMENT))%ALIGNMENT) * 4;
+    for (int frame = 0; frame < frameCount; frame++) {
+        uint8_t *image = decoder.readFrame();
+        if (image == nullptr) break;
+        input.frames.emplace_back(4 * width * height);
+        for (int y = 0; y < height; y++) {
+            copy(image + y*linesize, image + y*linesize + 4*width, input.frames.back().begin() + 4*width*y);
+        }
+    }
+    return input;
+}
+
+void benchmarkMapper(BenchmarkReport &report, const BenchmarkInput &input, const ColorLUT *colorLUT) {
+    struct Search {
+        const char *name;
+        FastPixelMap::SearchMethod method;
+        const ColorLUT *colorLUT;
+    };
+    vector<Search> searches = {{"mps", FastPixelMap::SearchMethod::MPS, nullptr}, {"vector", FastPixelMap::SearchMethod::Vector, nullptr}};
+    if (colorLUT != nullptr) searches.push_back({"lut", FastPixelMap::SearchMethod::MPS, colorLUT});
+    const pair<const char *, FastPixelMap::DitherMethod> dithers[] = {
+        {"sierra", FastPixelMap::DitherMethod::SierraLite},
+        {"bayer", FastPixelMap::DitherMethod::Bayer},
+        {"bluenoise", FastPixelMap::DitherMethod::BlueNoise}
+    };
+    int pixelCount = input.width * input.height;
+    vector<uint8_t> pal8Image(pixelCount);
+
+    for (auto& search : searches) {
+        for (auto& dither : dithers) {
+            FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, input.width, input.height, false);
+            pixelMapper.setColorLUT(search.colorLUT);
+            pixelMapper.setSearchMethod(search.method);
+            pixelMapper.setDitherMethod(dither.second);
+            long long frames = 0;
+            double seconds = timePasses([&]() {
+                for (auto& frame : input.frames) {
+                    pixelMapper.convertImage((uint8_t*) frame.data(), pal8Image.data());
+                }
+                frames += input.frames.size();
+            });
+            report.addResult({"mapper", input.name, string(search.name) + " " + dither.first, frames, seconds, pixelCount, frames * pixelCount});
+        }
+    }
+}
+
+void benchmarkFullSearch(BenchmarkReport &report, const BenchmarkInput &input) {
+    FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, input.width, input.height, false);
+    long long frames = 0;
+    double seconds = timePasses([&]() {
+        for (auto& frame : input.frames) {
+            delete[] pixelMapper.fullSearchConvertImage((uint8_t*) frame.data(), input.width, input.height, false);
+        }
+        frames += input.frames.size();
+    });
+    PaletteSearch paletteSearch((uint8_t*)expandedPalette, 256); // Only to name the kernel full search runs on
+    long long pixelCount = input.width * input.height;
+    report.addResult({"fullsearch", input.name, paletteSearch.getKernelName(), frames, seconds, pixelCount, frames * pixelCount});
+}
+
+void checkMPSSearch(BenchmarkReport &report, const BenchmarkInput &input) {
+    uint8_t *palette = (uint8_t*)expandedPalette;
+    FastPixelMap pixelMapper(palette, 256, input.width, input.height, false);
+    auto distance = [](const uint8_t *pixel, const uint8_t *color) {
+        return (pixel[0]-color[0])*(pixel[0]-color[0]) + (pixel[1]-color[1])*(pixel[1]-color[1]) + (pixel[2]-color[2])*(pixel[2]-color[2]);
+    };
+
+    BenchmarkCheck check = {"mps matches full search", input.name, 0, 0, 0, false};
+    for (auto& frame : input.frames) {
+        uint8_t *pal8Image = pixelMapper.fullSearchConvertImage((uint8_t*) frame.data(), input.width, input.height, false);
+        for (int i = 0; i < input.width * input.height; i++) {
+            const uint8_t *pixel = &frame[4*i];
+            int index = pixelMapper.mpsSearch(pixel[0], pixel[1], pixel[2]);
+            if (index == pal8Image[i]) continue;
+            if (distance(pixel, palette + 4*index) > distance(pixel, palette + 4*pal8Image[i])) check.mismatches++;
+            else check.ties++;
+        }
+        check.pixels += input.width * input.height;
+        delete[] pal8Image;
+    }
+    check.passed = check.mismatches * 1000 <= check.pixels * MAX_MISMATCHES_PER_THOUSAND;
+    report.addCheck(check);
+}
+
+void benchmarkEncoder(BenchmarkReport &report, const BenchmarkInput &input, GameImageFormat format) {
+    int pixelCount = input.width * input.height;
+    FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, input.width, input.height, false);
+    vector<vector<uint8_t>> pal8Frames;
+    for (auto& frame : input.frames) {
+        pal8Frames.emplace_back(pixelCount);
+        pixelMapper.convertImage((uint8_t*) frame.data(), pal8Frames.back().data());
+    }
+    vector<uint8_t> encodeBuffer;
+    string version = "v" + to_string((int) format);
+
+    long long frames = 0;
+    long long bytes = 0;
+    double seconds = timePasses([&]() {
+        for (auto& pal8Frame : pal8Frames) {
+            bytes += encodeGameImage(input.width, input.height, pal8Frame.data(), nullptr, encodeBuffer, format);
+        }
+        frames += pal8Frames.size();
+    });
+    report.addResult({"encoder", input.name, version + " keyframe", frames, seconds, pixelCount, bytes});
+
+    if (pal8Frames.size() < 2) return;
+    frames = 0;
+    bytes = 0;
+    seconds = timePasses([&]() {
+        for (size_t i = 1; i < pal8Frames.size(); i++) {
+            bytes += encodeGameImage(input.width, input.height, pal8Frames[i].data(), pal8Frames[i-1].data(), encodeBuffer, format);
+        }
+        frames += pal8Frames.size() - 1;
+    });
+    report.addResult({"encoder", input.name, version + " delta", frames, seconds, pixelCount, bytes});
+}
+
+void benchmarkDecoder(BenchmarkReport &report, string movie, int width, int height, int frameRate, int frameCount) {
+    const char *variants[] = {"filtered", "native", "native scaled"};
+    vector<uint8_t> bgraImage(4 * width * height);
+
+    for (int variant = 0; variant < 3; variant++) {
+        VideoDecoder decoder(width, height, frameRate, movie);
+        FrameScaler scaler(width, height, AV_PIX_FMT_BGRA);
+        long long frames = 0;
+        long long pixelsPerFrame = width * height;
+        auto start = chrono::steady_clock::now();
+        while (frames < frameCount) {
+            DecodedFrame frame = (variant == 0) ? decoder.readDecodedFrame() : decoder.readNativeFrame();
+            if (!frame) break;
+            if (variant == 1) pixelsPerFrame = (long long) frame.get()->width * frame.get()->height;
+            if (variant == 2 && !scaler.scale(frame.get(), bgraImage.data(), 4 * width)) break;
+            frames++;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (frames == 0) {
+            cerr << "Decoder benchmark: no frames in " << movie << endl;
+            return;
+        }
+        // Native frames stay in the codec's format, so only the BGRA variants have a size worth reporting
+        long long bytes = (variant == 1) ? 0 : frames * 4 * width * height;
+        report.addResult({"decoder", "movie", variants[variant], frames, seconds, pixelsPerFrame, bytes});
+    }
+}
+
+// Encodes synthetic frames into memory and prints the throughput of keyframes and of sparse and dense deltas.
+// The output stream is left out so only serialization is measured.
+void benchmarkGameImageEncoder(int width, int height, GameImageFormat format) {
+    int pixelCount = width * height;
+    vector<uint8_t> frame(pixelCount), oldFrame(pixelCount), buffer(maxEncodedFrameSize(width, height));
+    mt19937 random(1);
+    for (int i = 0; i < pixelCount; i++) {
+        frame[i] = random() & 255;
+    }
+
+    auto measure = [&](const char * name, uint8_t * old) {
+        size_t bytes = 0;
+        int frames = 0;
+        double seconds = timePasses([&]() {
+            for (int i = 0; i < 16; i++) {
+                bytes += encodeGameImage(width, height, frame.data(), old, buffer, format);
+            }
+            frames += 16;
+        });
+        cout << name << ": " << frames / seconds << " frames/s, " << bytes / seconds / (1 << 20) << " MiB/s, "
+             << bytes / frames << " bytes/frame" << endl;
+    };
+
+    cout << "Encoding " << width << "x" << height << " frames, format version " << (int) format << endl;
+    measure("Keyframe", nullptr);
+    // About 1 in 32 pixels differs from the previous frame, roughly what a mostly static scene produces
+    for (int i = 0; i < pixelCount; i++) {
+        oldFrame[i] = (random() % 32 == 0) ? (uint8_t) ~frame[i] : frame[i];
+    }
+    measure("Sparse delta", oldFrame.data());
+    // The middle half of every row changed, like something moving in front of a still background
+    for (int i = 0; i < pixelCount; i++) {
+        int x = i % width;
+        oldFrame[i] = (x >= width / 4 && x < width * 3 / 4) ? (uint8_t) ~frame[i] : frame[i];
+    }
+    measure("Region delta", oldFrame.data());
+}
@@ -0,0 +1,88 @@
+#ifndef BENCHMARK_HPP_INCLUDED
+#define BENCHMARK_HPP_INCLUDED
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include "colorlut.hpp"
+#include "gameimage.hpp"
+
+// One measured stage. Rates are derived from frames, seconds and pixelsPerFrame when the report is written.
+struct BenchmarkResult {
+    std::string stage;
+    std::string input; // "synthetic" or "movie"
+    std::string variant;
+    long long frames;
+    double seconds;
+    long long pixelsPerFrame;
+    long long bytes; // Output of the stage, 0 when it has no meaningful size
+};
+
+// Mismatches are pixels whose MPS color is farther than the full search one. Different indices at the same distance are ties.
+struct BenchmarkCheck {
+    std::string check;
+    std::string input;
+    long long pixels;
+    long long ties;
+    long long mismatches;
+    bool passed;
+};
+
+// Unpadded BGRA frames a benchmark runs on
+struct BenchmarkInput {
+    std::string name;
+    int width;
+    int height;
+    std::vector<std::vector<uint8_t>> frames;
+};
+
+// Collects the results and checks of a --benchmark run and writes them as one JSON document, so runs of different
+// versions can be compared by a script
+class BenchmarkReport {
+
+public:
+    BenchmarkReport(int width, int height, std::string movie) {
+        this->width = width;
+        this->height = height;
+        this->movie = movie;
+    }
+
+    void addResult(const BenchmarkResult &result);
+    void addCheck(const BenchmarkCheck &check);
+    bool allChecksPassed() const;
+    void write(std::ostream &out) const;
+
+private:
+    int width;
+    int height;
+    std::string movie; // Empty for synthetic input only
+    std::vector<BenchmarkResult> results;
+    std::vector<BenchmarkCheck> checks;
+
+};
+
+// Repeats pass until at least a quarter second has gone by, long enough to hide timer resolution at any size.
+// Returns the seconds taken.
+double timePasses(const std::function<void()> &pass);
+
+// Draws frame of a synthetic BGRA scene: a still gradient with a ball moving across it
+void drawBenchmarkScene(std::vector<uint8_t> & image, int width, int height, int frame, int frameCount);
+BenchmarkInput syntheticBenchmarkInput(int width, int height, int frameCount);
+// The movie's first frameCount frames, decoded and scaled like a conversion would. Fewer at EOF.
+BenchmarkInput movieBenchmarkInput(std::string movie, int width, int height, int frameRate, int frameCount);
+
+// FastPixelMap::convertImage with every search (and the LUT, if given) and dither method
+void benchmarkMapper(BenchmarkReport &report, const BenchmarkInput &input, const ColorLUT *colorLUT);
+// FastPixelMap::fullSearchConvertImage, the undithered reference
+void benchmarkFullSearch(BenchmarkReport &report, const BenchmarkInput &input);
+// Compares undithered MPS search against full search on every pixel of the input
+void checkMPSSearch(BenchmarkReport &report, const BenchmarkInput &input);
+// encodeGameImage on the Sierra Lite mapped input, as keyframes and as deltas to the previous frame
+void benchmarkEncoder(BenchmarkReport &report, const BenchmarkInput &input, GameImageFormat format);
+// VideoDecoder through the filter graph, natively, and natively followed by a FrameScaler
+void benchmarkDecoder(BenchmarkReport &report, std::string movie, int width, int height, int frameRate, int frameCount);
+// Prints encoder throughput for keyframes and sparse deltas of the given size
+void benchmarkGameImageEncoder(int width, int height, GameImageFormat format);
+
+#endif // BENCHMARK_HPP_INCLUDED
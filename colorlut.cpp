@@ -0,0 +1,160 @@
+#include "colorlut.hpp"
+#include "fastpixelmap.hpp"
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Bump whenever FastPixelMap's search changes in a way that could change which index is chosen.
+// Old cache files are then simply ignored instead of silently producing different output.
+const uint32_t COLOR_LUT_VERSION = 1;
+const char COLOR_LUT_MAGIC[8] = {'C', 'C', 'V', 'P', 'L', 'U', 'T', '\0'};
+const int COLOR_LUT_HEADER_SIZE = 64; // Header is padded so the table itself starts on a cache line
+
+struct ColorLUTHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t paletteSize;
+    uint64_t paletteKey;
+};
+
+
+ColorLUT::~ColorLUT() {
+    if (mappedRegion != nullptr) munmap(mappedRegion, mappedSize);
+    delete[] ownedTable;
+}
+
+// 64-bit FNV-1a over the BGR values of the palette. Alpha is ignored since FastPixelMap never reads it.
+uint64_t ColorLUT::calculatePaletteKey() {
+    uint64_t hash = 14695981039346656037ULL;
+    auto addByte = [&hash](uint8_t byte) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    };
+    for (int i = 0; i < paletteSize*4; i+=4) {
+        addByte(palette[i]);
+        addByte(palette[i+1]);
+        addByte(palette[i+2]);
+    }
+    for (int i = 0; i < 4; i++) addByte((paletteSize >> (8*i)) & 0xff);
+    for (int i = 0; i < 4; i++) addByte((COLOR_LUT_VERSION >> (8*i)) & 0xff);
+    return hash;
+}
+
+string ColorLUT::getCachePath() const {
+    char keyString[17];
+    snprintf(keyString, sizeof(keyString), "%016llx", (unsigned long long) paletteKey);
+    string directory = cacheDirectory;
+    if (!directory.empty() && directory.back() != '/') directory += '/';
+    return directory + "palette-" + keyString + ".lut";
+}
+
+bool ColorLUT::loadTable() {
+    if (cacheDirectory.empty()) return false;
+
+    string path = getCachePath();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false; // No cached table yet
+
+    struct stat fileInfo;
+    size_t expectedSize = COLOR_LUT_HEADER_SIZE + TABLE_SIZE;
+    if (fstat(fd, &fileInfo) != 0 || (size_t) fileInfo.st_size != expectedSize) {
+        cerr << "ColorLUT: Ignoring cache file with unexpected size: " << path << endl;
+        close(fd);
+        return false;
+    }
+
+    void *region = mmap(nullptr, expectedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (region == MAP_FAILED) {
+        cerr << "ColorLUT: mmap failed for " << path << endl;
+        return false;
+    }
+
+    const ColorLUTHeader *header = (const ColorLUTHeader *) region;
+    if (memcmp(header->magic, COLOR_LUT_MAGIC, sizeof(COLOR_LUT_MAGIC)) != 0 || header->version != COLOR_LUT_VERSION
+            || header->paletteSize != (uint32_t) paletteSize || header->paletteKey != paletteKey) {
+        cerr << "ColorLUT: Ignoring cache file with mismatched header: " << path << endl;
+        munmap(region, expectedSize);
+        return false;
+    }
+
+    mappedRegion = region;
+    mappedSize = expectedSize;
+    table = (const uint8_t *) region + COLOR_LUT_HEADER_SIZE;
+    return true;
+}
+
+// Runs FastPixelMap's MPS search once for every possible color. Each thread gets its own FastPixelMap
+// and a contiguous range of red values, so there is no shared mutable state besides disjoint parts of the table.
+bool ColorLUT::buildTable() {
+    ownedTable = new uint8_t[TABLE_SIZE];
+
+    int threadCount = thread::hardware_concurrency();
+    if (threadCount < 1) threadCount = 1;
+    if (threadCount > 256) threadCount = 256;
+
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([this, t, threadCount]() {
+            FastPixelMap pixelMapper(palette, paletteSize, 1, 1, false);
+            for (int red = t; red < 256; red += threadCount) {
+                uint8_t *row = ownedTable + (red << 16);
+                for (int green = 0; green < 256; green++) {
+                    for (int blue = 0; blue < 256; blue++) {
+                        row[(green << 8) | blue] = pixelMapper.mpsSearch(blue, green, red);
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    table = ownedTable;
+    return true;
+}
+
+// Writes to a temporary file and renames it into place, so concurrent runs never see a half-written table.
+bool ColorLUT::saveTable() {
+    string path = getCachePath();
+    string tempPath = path + ".tmp." + to_string(getpid());
+
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    uint8_t headerBytes[COLOR_LUT_HEADER_SIZE] = {};
+    ColorLUTHeader header;
+    memcpy(header.magic, COLOR_LUT_MAGIC, sizeof(COLOR_LUT_MAGIC));
+    header.version = COLOR_LUT_VERSION;
+    header.paletteSize = paletteSize;
+    header.paletteKey = paletteKey;
+    memcpy(headerBytes, &header, sizeof(header));
+
+    bool success = true;
+    const uint8_t *chunks[2] = {headerBytes, table};
+    size_t chunkSizes[2] = {COLOR_LUT_HEADER_SIZE, TABLE_SIZE};
+    for (int i = 0; i < 2 && success; i++) {
+        size_t written = 0;
+        while (written < chunkSizes[i]) {
+            ssize_t result = write(fd, chunks[i] + written, chunkSizes[i] - written);
+            if (result <= 0) {
+                success = false;
+                break;
+            }
+            written += result;
+        }
+    }
+
+    if (close(fd) != 0) success = false;
+    if (success && rename(tempPath.c_str(), path.c_str()) != 0) success = false;
+    if (!success) unlink(tempPath.c_str());
+    return success;
+}
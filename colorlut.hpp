@@ -0,0 +1,64 @@
+#ifndef COLORLUT_HPP_INCLUDED
+#define COLORLUT_HPP_INCLUDED
+#include <iostream>
+#include <string>
+#include <cstdint>
+
+// Precomputed table mapping every 24-bit BGR color to the palette index FastPixelMap's MPS search would choose.
+// After dithering and clamping, there are only 2^24 possible inputs, so mapping a pixel becomes a single memory load.
+// The table is 16 MiB. It is built in parallel, saved to cacheDirectory under a key derived from the palette contents,
+// and mmap'd read-only on later runs, so every converter thread (and every process) shares one copy.
+// Leave cacheDirectory empty to build the table in memory without touching the disk.
+class ColorLUT {
+
+public:
+    ColorLUT(uint8_t *palette, int paletteSize, std::string cacheDirectory) {
+        this->palette = palette;
+        this->paletteSize = paletteSize;
+        this->cacheDirectory = cacheDirectory;
+        table = nullptr;
+        ownedTable = nullptr;
+        mappedRegion = nullptr;
+        mappedSize = 0;
+        paletteKey = calculatePaletteKey();
+
+        if (paletteSize > 256) {
+            std::cerr << "ColorLUT: Palettes with more than 256 colors are not supported." << std::endl;
+            return;
+        }
+        if (!loadTable()) {
+            if (!buildTable()) std::cerr << "Failed to build Color LUT!" << std::endl;
+            else if (!cacheDirectory.empty() && !saveTable()) std::cerr << "ColorLUT: Could not save table to " << cacheDirectory << std::endl;
+        }
+    }
+
+    ~ColorLUT();
+
+    // blue, green, and red must already be clamped to [0, 255]
+    uint8_t lookup(int blue, int green, int red) const {
+        return table[(red << 16) | (green << 8) | blue];
+    }
+    bool isValid() const { return table != nullptr; }
+    std::string getCachePath() const;
+
+    static const int TABLE_SIZE = 1 << 24;
+
+private:
+    uint8_t *palette;
+    int paletteSize;
+    std::string cacheDirectory;
+    uint64_t paletteKey;
+
+    const uint8_t *table;
+    uint8_t *ownedTable; // Only set when the table was built in this process
+    void *mappedRegion; // Only set when the table was mmap'd from the cache
+    size_t mappedSize;
+
+    uint64_t calculatePaletteKey();
+    bool loadTable();
+    bool buildTable();
+    bool saveTable();
+
+};
+
+#endif // COLORLUT_HPP_INCLUDED
@@ -1,17 +1,40 @@
 #include "decodevideo.hpp"
+#include <cmath>
+#include <algorithm>
 
+// Timestamps are rounded to the stream's time base, so frame and output times that should match can be slightly off
+const double TIMESTAMP_TOLERANCE = 0.001;
+
+
+FrameScaler::~FrameScaler() {
+    sws_freeContext(pSwsContext);
+}
+
+bool FrameScaler::scale(const AVFrame * pSrcFrame, uint8_t * dst, int dstLinesize) {
+    // Only rebuilt when the source size or format changes, e.g. a resolution switch mid-stream
+    pSwsContext = sws_getCachedContext(pSwsContext, pSrcFrame->width, pSrcFrame->height, (AVPixelFormat)pSrcFrame->format,
+                                       dstWidth, dstHeight, dstFormat, SWS_BICUBIC, NULL, NULL, NULL);
+    if (pSwsContext == nullptr) {
+        std::cerr << "FrameScaler: Cannot convert from " << av_get_pix_fmt_name((AVPixelFormat)pSrcFrame->format) << std::endl;
+        return false;
+    }
+    uint8_t * dstData[4] = {dst, nullptr, nullptr, nullptr};
+    int dstLinesizes[4] = {dstLinesize, 0, 0, 0};
+    sws_scale(pSwsContext, pSrcFrame->data, pSrcFrame->linesize, 0, pSrcFrame->height, dstData, dstLinesizes);
+    return true;
+}
 
 void scaleImage(AVFrame * pFrame, int scaleX, int scaleY, AVFrame * pScaledFrame, AVPixelFormat pixfmt) {
-    // Use swscale to convert to rgb
-    SwsContext * pSwsContext = sws_getContext(pFrame->width, pFrame->height, (AVPixelFormat)pFrame->format, scaleX, scaleY, pixfmt, SWS_BICUBIC, NULL, NULL, NULL);
+    // Use swscale to convert to rgb. One scaler per thread, so repeated calls reuse its SwsContext.
+    thread_local FrameScaler scaler(scaleX, scaleY, pixfmt);
+    scaler.setOutput(scaleX, scaleY, pixfmt);
 //    const AVOption *testOption = av_opt_find(pSwsContext, "sws_dither", NULL, NULL, NULL);
 //    av_opt_set(pSwsContext, "sws_dither", "bayer", NULL);
     //cout << testOption->help << endl;
     //cout << testOption->name << endl;
     // Allocating data for RGB frame
     pScaledFrame->linesize[0] = av_image_get_linesize(pixfmt, scaleX, 0);
-    sws_scale(pSwsContext, pFrame->data, pFrame->linesize, 0, pFrame->height, pScaledFrame->data, pScaledFrame->linesize);
-    sws_freeContext(pSwsContext);
+    scaler.scale(pFrame, pScaledFrame->data[0], pScaledFrame->linesize[0]);
     return;
 
 }
@@ -110,8 +133,10 @@ int VideoDecoder::openInputFile() {
         return -1;
     }
 
-    pCodecContext->thread_count = 2; // This is bound to result in errors at some point. Changing it to >2 immediately causes errors. But it's faster! ~12s to ~8s total runtime
-    std::cout << "CODEC THREAD COUNT: " << pCodecContext->thread_count << std::endl;
+    // Frame threading needs readDecodedFrame to drain the decoder, since it keeps up to thread_count frames in flight.
+    // 0 lets FFMPEG pick from the number of cores. Codecs that support neither type just ignore this.
+    pCodecContext->thread_count = codecThreadCount;
+    pCodecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
     // Ready to open stream based on previous parameters
     result = avcodec_open2(pCodecContext, pVideoCodec, NULL);
@@ -122,6 +147,8 @@ int VideoDecoder::openInputFile() {
         avcodec_free_context(&pCodecContext);
         return -1;
     }
+    std::cout << "CODEC THREAD COUNT: " << pCodecContext->thread_count << " ("
+              << ((pCodecContext->active_thread_type & FF_THREAD_FRAME) ? "frame" : (pCodecContext->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none") << ")" << std::endl;
     return 0;
 }
 
@@ -180,71 +207,248 @@ int VideoDecoder::initializeFilters() {
 
 
 
-uint8_t* VideoDecoder::readFrame() {
-
+/*
+    Frame rate decimation happens on both sides of the decoder. Before a packet is sent, its pts predicts whether the frame
+    will be kept, and non-reference frames that won't be are discarded by the codec without being decoded. Frames that
+    still come out are checked again by presentation time, and only the first frame at or after each output frame's time
+    goes on to the filter graph. The prediction only decides how much work is skipped, never which frames are returned,
+    except that a non-reference frame it wrongly drops is replaced by the next frame.
 
+    Decoding follows FFMPEG's send/receive model. A frame threaded decoder holds on to several packets before it gives
+    back the first frame, and one packet can produce several frames, so packets and frames aren't one to one.
+    Frames already inside the decoder are always taken first. Only when it asks for more input (EAGAIN) is another packet
+    read and sent. At the end of the file, a null packet puts the decoder into draining mode, and the frames it still
+    holds come out one per call until it reports AVERROR_EOF.
+*/
+// Leaves the next kept frame in pFrame. Returns false at EOF.
+bool VideoDecoder::receiveNextFrame() {
 
-
-    while (av_read_frame(pFormatContext, pAVPacket) <= 0) {
-        if (pAVPacket->stream_index != videoStreamIndex) {
-            av_packet_unref(pAVPacket);
-            continue;
+    while (true) {
+        result = avcodec_receive_frame(pCodecContext, pFrame);
+        if (result == 0) {
+            framesDecoded++;
+            int64_t timestamp = pFrame->best_effort_timestamp;
+            if (timestamp != AV_NOPTS_VALUE && timestamp < seekTargetPts) { // Decoding forward from a keyframe to the seek target
+                av_frame_unref(pFrame);
+                continue;
+            }
+            double relTime;
+            if (timestamp != AV_NOPTS_VALUE) relTime = presentationTime(timestamp);
+            else relTime = framesProcessed / inputFrameRate; // No timestamp, use framesProcessed and inputFrameRate to get an approx timestamp
+            framesProcessed++;
+            if (clipDuration >= 0 && relTime >= clipDuration - TIMESTAMP_TOLERANCE) { // Past --end
+                av_frame_unref(pFrame);
+                return false;
+            }
+            if (relTime + TIMESTAMP_TOLERANCE < (double) framesReturned / outputFrameRate) { // If timestamp of framesProcessed is before the timestamp of framesDisplayed, then DON'T display another frame.
+                //std::cout << "Skipping frame: " << framesProcessed << std::endl;
+                av_frame_unref(pFrame);
+                continue;
+            }
+            if (endOutputFrame >= 0 && framesReturned >= endOutputFrame) { // Belongs to the next segment
+                av_frame_unref(pFrame);
+                return false;
+            }
+            framesReturned++;
+            return true;
+        } else if (result == AVERROR_EOF) {
+            std::cout << "Finished reading file" << std::endl;
+            return false;
+        } else if (result != AVERROR(EAGAIN)) {
+            printf("avcodec_receive_frame error: %s\n", av_err2str(result));
+            return false;
         }
 
-        // Send the data packet to the decoder
-        int sendPacketResult = avcodec_send_packet(pCodecContext, pAVPacket);
-        if (sendPacketResult == AVERROR(EAGAIN)){
-            std::cerr << "Decoder can't take packets right now. Make sure you are draining it." << std::endl;
-        }else if (sendPacketResult < AVERROR(ENOMEM)){
-            std::cerr << "Failed to send the packet to the decoder!" << std::endl;
+        // The decoder needs more input
+        if (isDraining) { // Can't happen, a draining decoder only returns frames or EOF
+            std::cerr << "Decoder asked for input after the end of the file!" << std::endl;
+            return false;
         }
-        // Receive decoded frame
-        result = avcodec_receive_frame(pCodecContext, pFrame);
-        if (result == AVERROR(EAGAIN)) {
+        if (av_read_frame(pFormatContext, pAVPacket) < 0) {
+            avcodec_send_packet(pCodecContext, nullptr); // End of file (or read error), flush out the buffered frames
+            isDraining = true;
+            continue;
+        }
+        if (pAVPacket->stream_index != videoStreamIndex) {
             av_packet_unref(pAVPacket);
             continue;
-        } else if (result == AVERROR_EOF) {
-            std::cout << "Finished reading file" << std::endl;
-            return nullptr;
-        } else if (result < 0) {
-            std::cout << "No frame was received from decoder!" << std::endl;
-            printf("avcodec_receive_frame error: %s\n", av_err2str(result));
         }
+        // Frames that won't be kept are only decoded if other frames reference them. Frame threads copy skip_frame
+        // from the context when the packet is submitted, so it can change from one packet to the next.
+        bool isNeeded = isFrameNeeded(pAVPacket->pts);
+        pCodecContext->skip_frame = isNeeded ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+        if (!isNeeded) packetsSkippable++;
+        int sendPacketResult = avcodec_send_packet(pCodecContext, pAVPacket);
+        packetsSent++;
         av_packet_unref(pAVPacket);
-        double relTime = framesProcessed++ / inputFrameRate; // Use framesProcessed and inputFrameRate to get an approx timestamp
-        if (relTime < (double) framesReturned / outputFrameRate) { // If timestamp of framesProcessed is before the timestamp of framesDisplayed, then DON'T display another frame.
-            //std::cout << "Skipping frame: " << framesProcessed << std::endl;
-            av_frame_unref(pFrame);
-            continue;
+        if (sendPacketResult < 0) { // A corrupt packet only loses its own frames, so keep going
+            printf("avcodec_send_packet error: %s\n", av_err2str(sendPacketResult));
         }
-        framesReturned++;
-        break;
     }
+}
+
+DecodedFrame VideoDecoder::readDecodedFrame() {
+
+    if (!receiveNextFrame()) return DecodedFrame();
 
     // Decoded frame is in pFrame. Now, the decoded, likely YUV, frame must be sent to the filtergraph to be scaled and converted to BGRA (RGB basically)
     if (av_buffersrc_add_frame_flags(pBufferSrcContext, pFrame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) std::cout << "Pushing to pBufferSrc failed" << std::endl;
-    while (true) {
-        int ret = av_buffersink_get_frame(pBufferSinkContext, pRGBFrame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
-        if (ret < 0)
-            std::cout << "Receive from pBufferSink failed" << std::endl;
-    }
     av_frame_unref(pFrame);
+    // One frame in gives one frame out, since the graph only scales and converts
+    int ret = av_buffersink_get_frame(pBufferSinkContext, pRGBFrame);
+    if (ret < 0) {
+        std::cout << "Receive from pBufferSink failed" << std::endl;
+        return DecodedFrame();
+    }
     //for (int i = 0; i < frameSizeInBytes/4096; i+=4) std::cout << (int)pRGBFrame->data[0][i+2];
-    resultBuffer = pRGBFrame->data[0];
-    av_frame_unref(pRGBFrame);
-    return resultBuffer;
+
+    // Hand our reference to the caller instead of copying. pRGBFrame is left blank for the next call.
+    AVFrame * pResultFrame = av_frame_alloc();
+    av_frame_move_ref(pResultFrame, pRGBFrame);
+    return DecodedFrame(pResultFrame);
 
 }
 
 
-// TODO: Make accurate frame seeking, not just by closest keyframe. Also, use the seek frame function with flags
+// Seconds since the start of the stream, or of the clip if one is set. timestamp must not be AV_NOPTS_VALUE.
+double VideoDecoder::presentationTime(int64_t timestamp) {
+    AVStream * pStream = pFormatContext->streams[videoStreamIndex];
+    int64_t startTime = (pStream->start_time == AV_NOPTS_VALUE) ? 0 : pStream->start_time;
+    return (timestamp - startTime) * av_q2d(pStream->time_base) - clipStartTime;
+}
+
+// Inverse of presentationTime, rounded down to the stream's time base
+int64_t VideoDecoder::streamTimestamp(double time) {
+    AVStream * pStream = pFormatContext->streams[videoStreamIndex];
+    int64_t startTime = (pStream->start_time == AV_NOPTS_VALUE) ? 0 : pStream->start_time;
+    return startTime + (int64_t) floor((time + clipStartTime) / av_q2d(pStream->time_base));
+}
+
+// A frame is kept if it is the first one at or after the time of an output frame, meaning the frame before it came
+// too early for that output frame. Same tolerance as the check in receiveNextFrame.
+// Frames without a pts, and every frame when not decimating, count as needed. Frames before a seek target never are.
+bool VideoDecoder::isFrameNeeded(int64_t pts) {
+    if (pts == AV_NOPTS_VALUE) return true;
+    if (pts < seekTargetPts) return false;
+    if (inputFrameRate <= outputFrameRate) return true;
+    double time = presentationTime(pts);
+    double slot = floor((time + TIMESTAMP_TOLERANCE) * outputFrameRate) / outputFrameRate; // Latest output frame time not after this frame
+    return slot - TIMESTAMP_TOLERANCE > time - 1 / inputFrameRate;
+}
+
+// Built on first use. Without a cache this reads through the whole file, though nothing is decoded.
+const FrameIndex & VideoDecoder::getFrameIndex() {
+    if (!frameIndex.isValid()) {
+        frameIndex.build(pFormatContext, videoStreamIndex, inputFileName, indexCachePath);
+        seekStart();
+    }
+    return frameIndex;
+}
+
+// The first output frame that a decoder starting at this keyframe produces. Earlier output frames are filled by frames
+// from before the keyframe, using the same rule as receiveNextFrame.
+int VideoDecoder::outputFrameAt(int64_t keyframePts) {
+    double time = presentationTime(keyframePts);
+    if (time <= 0) return 0;
+    if (inputFrameRate <= outputFrameRate) return (int) round(time * inputFrameRate); // Every frame is kept, so they are numbered in order
+    return (int) ceil((time - TIMESTAMP_TOLERANCE) * outputFrameRate);
+}
+
+// Jumps to a keyframe and numbers the frames from there on as if the file (or clip) had been decoded from the start.
+// Stops returning frames before output frame endOutputFrame, or at EOF if it is negative. The first segment starts
+// exactly at the start of the clip instead of at a keyframe.
+bool VideoDecoder::seekSegment(int64_t keyframePts, int firstOutputFrame, int endOutputFrame) {
+    bool isSeeked;
+    if (firstOutputFrame == 0) {
+        isSeeked = seekTime(0);
+    } else {
+        isSeeked = seekToKeyframe(keyframePts, INT64_MIN);
+    }
+    framesReturned = firstOutputFrame;
+    this->endOutputFrame = endOutputFrame;
+    return isSeeked;
+}
+
+// Only frames from startTime up to (not including) endTime are returned, and output frame times count from startTime.
+// A negative endTime means the end of the movie. Takes effect with the next seek.
+void VideoDecoder::setClip(double startTime, double endTime) {
+    clipStartTime = startTime;
+    clipDuration = (endTime < 0) ? -1 : endTime - startTime;
+}
+
+// Seeking always starts at a keyframe, since every other frame depends on earlier ones. The codec is flushed so
+// nothing from before the seek comes out, and frames before targetPts are decoded (when referenced) but never returned.
+bool VideoDecoder::seekToKeyframe(int64_t keyframePts, int64_t targetPts) {
+    int result = av_seek_frame(pFormatContext, videoStreamIndex, keyframePts, AVSEEK_FLAG_BACKWARD);
+    avcodec_flush_buffers(pCodecContext); // Also leaves draining mode
+    isDraining = false;
+    framesProcessed = 0;
+    framesReturned = 0;
+    framesDecoded = 0; // Packets still in the codec were flushed, so the decode statistics restart here too
+    packetsSent = 0;
+    packetsSkippable = 0;
+    endOutputFrame = -1;
+    seekTargetPts = targetPts;
+    if (result < 0) printf("av_seek_frame error: %s\n", av_err2str(result));
+    return result >= 0;
+}
+
+// Back to the first frame of the file, without needing the index
+bool VideoDecoder::seekStart() {
+    AVStream * pStream = pFormatContext->streams[videoStreamIndex];
+    int64_t startTime = (pStream->start_time == AV_NOPTS_VALUE) ? 0 : pStream->start_time;
+    return seekToKeyframe(startTime, INT64_MIN);
+}
+
+// Seeks so the next frame returned is the first one at or after time (in seconds from the start of the clip)
+bool VideoDecoder::seekTime(double time) {
+    if (time + clipStartTime <= 0) return seekStart();
+    const FrameIndex & index = getFrameIndex();
+    size_t targetFrame = index.frameAtOrAfter(streamTimestamp(time - TIMESTAMP_TOLERANCE));
+    if (targetFrame >= index.getFrameCount()) return false;
+    int64_t targetPts = index.framePts[targetFrame];
+    return seekToKeyframe(index.keyframeAtOrBefore(targetPts), targetPts);
+}
+
+int VideoDecoder::getFramesNotDecoded() {
+    return packetsSent - framesDecoded;
+}
+
+DecodedFrame VideoDecoder::readNativeFrame() {
+
+    if (!receiveNextFrame()) return DecodedFrame();
+
+    AVFrame * pResultFrame = av_frame_alloc();
+    av_frame_move_ref(pResultFrame, pFrame);
+    return DecodedFrame(pResultFrame);
+}
+
+// Copies the frame into RGBBuffer, so the result stays valid after the frame's own buffer is released.
+// Rows are laid out with the padding everyone else expects from ALIGNMENT, whatever linesize the filter graph chose.
+uint8_t* VideoDecoder::readFrame() {
+
+    DecodedFrame frame = readDecodedFrame();
+    if (!frame) return nullptr;
+
+    int linesize = (width+padCount)*4;
+    int rowBytes = std::min(linesize, frame.linesize());
+    for (int heightIndex = 0; heightIndex < height; heightIndex++) {
+        std::copy(frame.data() + heightIndex*frame.linesize(), frame.data() + heightIndex*frame.linesize() + rowBytes, RGBBuffer + heightIndex*linesize);
+    }
+    return RGBBuffer;
+}
+
+
+
+
+// Seeks so the next frame returned is frame frameNumber of the movie, counted in presentation order
 bool VideoDecoder::seekFrame(int frameNumber) {
 
-    int result = av_seek_frame(pFormatContext, videoStreamIndex, frameNumber, NULL);
-    //std::cout << "seekFrame: " << result << std::endl;
-    return true;
+    if (frameNumber <= 0) return seekStart();
+    const FrameIndex & index = getFrameIndex();
+    if ((size_t) frameNumber >= index.getFrameCount()) return false;
+    int64_t targetPts = index.framePts[frameNumber];
+    return seekToKeyframe(index.keyframeAtOrBefore(targetPts), targetPts);
 
 }
 
@@ -256,3 +460,10 @@ double VideoDecoder::getFrameRate() {
     return inputFrameRate;
 }
 
+double VideoDecoder::getDuration() {
+    if (pFormatContext->duration == AV_NOPTS_VALUE) return clipDuration;
+    double remaining = std::max(pFormatContext->duration / (double) AV_TIME_BASE - clipStartTime, 0.0);
+    if (clipDuration >= 0) return std::min(clipDuration, remaining);
+    return remaining;
+}
+
@@ -5,6 +5,8 @@
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <vector>
+#include "frameindex.hpp"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -34,6 +36,36 @@ return (std::string)errbuf;
 #define ALIGNMENT 64
 #endif
 
+// Scales and converts decoded frames to one output size and format. Keeps its SwsContext between calls, and only
+// rebuilds it when the source size or format changes. Not thread-safe, give each thread its own.
+class FrameScaler {
+
+public:
+    FrameScaler(int dstWidth, int dstHeight, AVPixelFormat dstFormat) {
+        pSwsContext = nullptr;
+        setOutput(dstWidth, dstHeight, dstFormat);
+    }
+    FrameScaler(const FrameScaler &) = delete;
+    FrameScaler & operator=(const FrameScaler &) = delete;
+
+    ~FrameScaler();
+
+    void setOutput(int dstWidth, int dstHeight, AVPixelFormat dstFormat) {
+        this->dstWidth = dstWidth;
+        this->dstHeight = dstHeight;
+        this->dstFormat = dstFormat;
+    }
+    // Writes a single plane image with rows dstLinesize bytes apart. Returns false if the source can't be converted.
+    bool scale(const AVFrame * pSrcFrame, uint8_t * dst, int dstLinesize);
+
+private:
+    SwsContext * pSwsContext;
+    int dstWidth;
+    int dstHeight;
+    AVPixelFormat dstFormat;
+
+};
+
 void scaleImage(AVFrame * pFrame, int scaleX, int scaleY, AVFrame * pScaledFrame, AVPixelFormat pixfmt);
 
 // Writes a simple .ppm image. Must be given BGRA pixels. Does not bounds check.
@@ -41,13 +73,58 @@ int writePPM(std::string outputFileName, int width, int height, uint8_t *data, b
 int writePal8PPM(std::string outputFileName, int width, int height, uint8_t *data, uint8_t *palette);
 
 
+// Owns one reference to a decoded frame. Move-only. The frame's buffer goes back to FFMPEG's frame pool when the
+// DecodedFrame is destroyed, so it can be passed between threads and released by whoever finishes with it last.
+class DecodedFrame {
+
+public:
+    DecodedFrame() {
+        pFrame = nullptr;
+    }
+    explicit DecodedFrame(AVFrame * pFrame) {
+        this->pFrame = pFrame;
+    }
+    DecodedFrame(DecodedFrame &&other) noexcept {
+        pFrame = other.pFrame;
+        other.pFrame = nullptr;
+    }
+    DecodedFrame & operator=(DecodedFrame &&other) noexcept {
+        if (this != &other) {
+            av_frame_free(&pFrame);
+            pFrame = other.pFrame;
+            other.pFrame = nullptr;
+        }
+        return *this;
+    }
+    DecodedFrame(const DecodedFrame &) = delete;
+    DecodedFrame & operator=(const DecodedFrame &) = delete;
+
+    ~DecodedFrame() {
+        av_frame_free(&pFrame); // Safe on nullptr
+    }
+
+    uint8_t * data() const { return pFrame->data[0]; }
+    int linesize() const { return pFrame->linesize[0]; }
+    AVFrame * get() const { return pFrame; }
+    explicit operator bool() const { return pFrame != nullptr; }
+
+private:
+    AVFrame * pFrame;
+
+};
+
+
 class VideoDecoder {
 
 public:
-    VideoDecoder(int width, int height, int frameRate, std::string inputFileName) {
+    // codecThreadCount is the number of decoding threads, or 0 to let FFMPEG pick from the number of cores
+    VideoDecoder(int width, int height, int frameRate, std::string inputFileName, int codecThreadCount = 0) {
 
-        framesProcessed = 0; // Total number of frames decoded
+        framesProcessed = 0; // Frames decoded at or after the seek target
         framesReturned = 0; // Total number of frames returned to the caller of readFrame. Always lower than framesProcessed since outputFrameRate will (almost) always be lower
+        framesDecoded = 0; // Every frame the codec gave back, including the ones dropped after a seek or by decimation
+        packetsSent = 0;
+        packetsSkippable = 0; // Packets sent while the codec was told to skip non-reference frames
         padCount = (ALIGNMENT-(width%ALIGNMENT))%ALIGNMENT;
         frameSizeInBytes = (width+padCount) * height * 4; // BGRA
 
@@ -55,6 +132,12 @@ public:
         this->height = height;
         this->outputFrameRate = frameRate;
         this->inputFileName = inputFileName;
+        this->codecThreadCount = codecThreadCount;
+        isDraining = false;
+        endOutputFrame = -1;
+        seekTargetPts = INT64_MIN;
+        clipStartTime = 0;
+        clipDuration = -1;
         filterDescription = std::string("scale=w=") + std::to_string(width) + ":h=" + std::to_string(height) + ":flags=bicubic,format=pix_fmts=" + av_get_pix_fmt_name(AV_PIX_FMT_RGB24);
 
 
@@ -81,24 +164,60 @@ public:
         av_packet_free(&pAVPacket);
         delete[] frameBuffer;
         delete[] RGBBuffer;
-        delete[] resultBuffer;
+        avfilter_graph_free(&pFilterGraph);
+        avcodec_free_context(&pCodecContext);
         avformat_close_input(&pFormatContext);
     }
 
+    // Returns a padded BGRA frame in a buffer owned by the decoder. Only valid until the next call.
     uint8_t *readFrame();
+    // Returns a reference to the next BGRA frame without copying it. Empty at EOF.
+    DecodedFrame readDecodedFrame();
+    // Returns the next frame as it came out of the codec, unscaled and likely YUV. Scale it with a FrameScaler.
+    // Skips the filter graph, so scaling can run on other threads. Empty at EOF.
+    DecodedFrame readNativeFrame();
+    // Exact seeks. Both jump to the nearest earlier keyframe and decode forward, and both need the frame index.
     bool seekFrame(int frameNumber);
+    bool seekTime(double time);
+    void setClip(double startTime, double endTime);
+    // Where the index is cached, e.g. next to the movie. Must be set before the index is first used. Empty disables it.
+    void setIndexCachePath(std::string indexCachePath) { this->indexCachePath = indexCachePath; }
+    const FrameIndex & getFrameIndex();
+    void setFrameIndex(const FrameIndex &frameIndex) { this->frameIndex = frameIndex; }
+    double presentationTime(int64_t timestamp);
+
+    // Segments let several decoders each convert part of a file. Keyframe pts are in the stream's time base.
+    int outputFrameAt(int64_t keyframePts);
+    bool seekSegment(int64_t keyframePts, int firstOutputFrame, int endOutputFrame);
     void printVideoInfo();
     double getFrameRate();
+    // Seconds left to convert: the clip set by setClip, cut short by the end of the movie. -1 if the container doesn't say.
+    double getDuration();
+    // Frames the codec discarded without decoding because they weren't going to be kept, since the last seek. Exact once
+    // EOF is reached.
+    int getFramesNotDecoded();
+    int getPacketsSkippable() { return packetsSkippable; }
     int frameSizeInBytes;
 
 private:
 
     int framesProcessed;
     int framesReturned;
+    int framesDecoded;
+    int packetsSent;
+    int packetsSkippable;
     int width;
     int height;
     int outputFrameRate;
     std::string inputFileName;
+    int codecThreadCount;
+    bool isDraining; // End of file was reached and the decoder is giving back the frames it still holds
+    int endOutputFrame; // Output frame the current segment ends before, or -1 to run to EOF
+    int64_t seekTargetPts; // Frames before this are being decoded forward past after a seek
+    double clipStartTime;
+    double clipDuration; // -1 runs to the end of the movie
+    std::string indexCachePath;
+    FrameIndex frameIndex;
 
 
 
@@ -112,7 +231,6 @@ private:
     AVFrame * pRGBFrame;
     int scaledBufferByteCount;
     double inputFrameRate;
-    uint8_t * resultBuffer;
     uint8_t * frameBuffer;
     uint8_t * RGBBuffer;
 
@@ -125,6 +243,12 @@ private:
     int padCount;
 
 
+    bool receiveNextFrame();
+    int64_t streamTimestamp(double time);
+    bool seekToKeyframe(int64_t keyframePts, int64_t targetPts);
+    bool seekStart();
+    bool isFrameNeeded(int64_t pts);
+
     int openInputFile();
     int initializeFilters();
 
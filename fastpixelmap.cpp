@@ -1,9 +1,14 @@
 #include "fastpixelmap.hpp"
 #include <algorithm>
+#include <climits>
+#include <cstring>
+#include <emmintrin.h>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
-int PIXEL_SIZE_IN_BYTES = 4;
+const int PIXEL_SIZE_IN_BYTES = 4;
 
 bool BGRAcmp(const BGRAPixel &a, const BGRAPixel &b) {
     int meanA = ((int)a.red+a.green+a.blue)/3;
@@ -37,27 +42,16 @@ uint8_t* FastPixelMap::fullSearchConvertImage(uint8_t *image, int imageWidth, in
 
     int padCount = (ALIGNMENT-(imageWidth%ALIGNMENT))%ALIGNMENT; // padCount in terms of pixels
     for (int heightIndex = 0; heightIndex < imageHeight; heightIndex++) {
-        for (int widthIndex = 0; widthIndex < imageWidth*PIXEL_SIZE_IN_BYTES; widthIndex+=PIXEL_SIZE_IN_BYTES) {
 
-            int offset;
-            if (isPadded) {
-                offset = (imageWidth+padCount)*heightIndex*PIXEL_SIZE_IN_BYTES + widthIndex;
-            } else {
-                offset = imageWidth*heightIndex*PIXEL_SIZE_IN_BYTES + widthIndex;
-            }
-
-            int sedMin = 10000000; // Impossible to reach for 8-bit color channels
-            int indexMin = -1;
-
-            for (int k = 0; k < paletteSize; k++) {
-                int testSed = sed(image+offset, palette+k*PIXEL_SIZE_IN_BYTES);
-                if (testSed < sedMin) {
-                    sedMin = testSed;
-                    indexMin = k;
-                }
-            }
-            pal8Image[heightIndex*imageWidth+widthIndex/PIXEL_SIZE_IN_BYTES] = indexMin;
+        int offset;
+        if (isPadded) {
+            offset = (imageWidth+padCount)*heightIndex*PIXEL_SIZE_IN_BYTES;
+        } else {
+            offset = imageWidth*heightIndex*PIXEL_SIZE_IN_BYTES;
         }
+
+        // No dithering, so every pixel in the row is independent and can be searched several at a time
+        paletteSearch.findClosestRow(image+offset, imageWidth, pal8Image+heightIndex*imageWidth);
     }
     //displayPalette(palette, paletteSize);
 
@@ -78,10 +72,29 @@ uint8_t* FastPixelMap::fullSearchConvertImage(uint8_t *image, int imageWidth, in
 uint8_t* FastPixelMap::convertImage(uint8_t *image) {
 
     uint8_t* pal8Image = new uint8_t[imageWidth * imageHeight];
+    convertImage(image, pal8Image);
+    return pal8Image;
+}
 
+// Same as above, but writes into pal8Image, which must hold imageWidth*imageHeight bytes.
+void FastPixelMap::convertImage(uint8_t *image, uint8_t *pal8Image) {
+    convertImage(image, defaultLinesize(), pal8Image);
+}
 
-    int padCount = (ALIGNMENT-(imageWidth%ALIGNMENT))%ALIGNMENT; // padCount in terms of pixels
-    int offset = 0;
+// For frames whose rows are linesize bytes apart, e.g. straight out of an AVFrame, instead of following isPadded.
+void FastPixelMap::convertImage(uint8_t *image, int linesize, uint8_t *pal8Image) {
+
+    imageLinesize = linesize;
+
+    if (isStaticTiles) {
+        convertImageTiled(image, pal8Image);
+        return;
+    }
+
+    if (ditherMethod != DitherMethod::SierraLite) {
+        convertImageOrdered(image, pal8Image);
+        return;
+    }
 
     /*
     Dithering: Spreading the error between the source color and chosen palette color to neighboring pixels.
@@ -92,135 +105,480 @@ uint8_t* FastPixelMap::convertImage(uint8_t *image) {
          X  1/2
     1/4 1/4
     */
-    int diffSum = 0;
+    if (frameThreads > 1 && imageHeight > 1) {
+        convertImageWavefront(image, pal8Image);
+        return;
+    }
+
+    fill(colorErrorRow1, colorErrorRow1 + 3*errorPlaneSize, 0); // First row has no incoming error
     for (int heightIndex = 0; heightIndex < imageHeight; heightIndex++) {
+        convertRow(image + rowOffset(heightIndex), pal8Image + heightIndex*imageWidth, heightIndex*imageWidth, imageWidth, colorErrorRow1, colorErrorRow2, nullptr, nullptr);
+        swapArrays();
+    } // End row
+}
 
-        for (int widthIndex = 0; widthIndex < imageWidth*PIXEL_SIZE_IN_BYTES; widthIndex+=PIXEL_SIZE_IN_BYTES) {
+/*
+Wavefront scheduling: A pixel only sends error right, down, and down-left, so row r+1 can run on another thread as soon as
+row r is a few pixels ahead of it. Each row waits until the row above has finished the pixel up and to the right of the one
+after it (3 pixels ahead). At that point the error flowing into the current pixel is final, and a row only writes the error
+row below it, so no two threads ever touch the same error entry at the same time. Every entry receives exactly the same
+additions as in the serial loop, so the output is byte-identical.
+
+Rows are dealt out round-robin, so a thread only starts row r+frameThreads after finishing row r. Error rows live in a
+ring of frameThreads+1 rows. The row a thread overwrites while on row r (the one for row r+1) last belonged to row
+r-frameThreads, which that same thread has already finished.
+*/
+void FastPixelMap::convertImageWavefront(uint8_t *image, uint8_t *pal8Image) {
+
+    int threadCount = min(frameThreads, imageHeight);
+    int ringSize = threadCount + 1;
+    int errorRowSize = 3*errorPlaneSize;
+
+    fill(wavefrontErrorRows, wavefrontErrorRows + errorRowSize, 0); // First row has no incoming error
+    for (int i = 0; i < imageHeight; i++) rowProgress[i].store(0, memory_order_relaxed);
+
+    auto runRows = [&](int firstRow) {
+        for (int heightIndex = firstRow; heightIndex < imageHeight; heightIndex += threadCount) {
+            int16_t *currentErrorRow = wavefrontErrorRows + (heightIndex % ringSize) * errorRowSize;
+            int16_t *nextErrorRow = wavefrontErrorRows + ((heightIndex+1) % ringSize) * errorRowSize;
+            convertRow(image + rowOffset(heightIndex), pal8Image + heightIndex*imageWidth, heightIndex*imageWidth, imageWidth, currentErrorRow, nextErrorRow,
+                       (heightIndex > 0) ? &rowProgress[heightIndex-1] : nullptr, &rowProgress[heightIndex]);
+        }
+    };
 
-            int rawBlue = image[offset] + colorErrorRow1[widthIndex];
-            int rawGreen = image[offset+1] + colorErrorRow1[widthIndex+1];
-            int rawRed = image[offset+2] + colorErrorRow1[widthIndex+2];
+    runOnFrameThreads(threadCount, runRows);
+}
 
-            int blue = intClamp(rawBlue, 0, 255);
-            int green = intClamp(rawGreen, 0, 255);
-            int red = intClamp(rawRed, 0, 255);
+// Dithers and maps pixelCount pixels of a row, usually all of them. currentErrorRow holds the error flowing into them and
+// is overwritten with their colors plus that error. nextErrorRow is overwritten with the error for the row below, so neither
+// needs clearing between rows. firstPixel is the index of the first one in the frame.
+// When previousRowProgress is set, waits for the row above to stay far enough ahead (see above).
+template <bool USE_LUT, FastPixelMap::SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+void FastPixelMap::convertRowKernel(uint8_t *imageRow, uint8_t *pal8Row, int firstPixel, int pixelCount, int16_t *currentErrorRow, int16_t *nextErrorRow,
+                                    const atomic<int> *previousRowProgress, atomic<int> *progress) {
+
+    const int16_t *blues = currentErrorRow;
+    const int16_t *greens = currentErrorRow + errorPlaneSize;
+    const int16_t *reds = currentErrorRow + 2*errorPlaneSize;
+
+    int knownPreviousProgress = 0;
+    int readyPixels = 0; // Pixels whose colors already include the error from the row above
+    if (previousRowProgress == nullptr) {
+        addIncomingError(imageRow, currentErrorRow, 0, pixelCount);
+        readyPixels = pixelCount;
+    }
+    int rightError[3] = {0, 0, 0};
 
-//            blue = rawBlue;
-//            green = rawGreen;
-//            red = rawRed;
+    for (int pixelIndex = 0; pixelIndex < pixelCount; pixelIndex++) {
 
+        if (pixelIndex == readyPixels) {
+            int pixelsNeeded = min(pixelIndex + 3, pixelCount);
+            for (int spins = 0; knownPreviousProgress < pixelsNeeded; spins++) {
+                knownPreviousProgress = previousRowProgress->load(memory_order_acquire);
+                if (spins > 64) this_thread::yield(); // The row above's thread was preempted, let it run
+            }
+            // An entry is final once the row above is past the pixel up and to the right of it
+            readyPixels = (knownPreviousProgress == pixelCount) ? pixelCount : knownPreviousProgress - 1;
+            addIncomingError(imageRow, currentErrorRow, pixelIndex, readyPixels);
+        }
 
+        int blue = intClamp(*blues++ + rightError[0], 0, 255);
+        int green = intClamp(*greens++ + rightError[1], 0, 255);
+        int red = intClamp(*reds++ + rightError[2], 0, 255);
 
+        int indexMin = findIndex<USE_LUT, SEARCH, PALETTE_SIZE, TEMPORAL_REUSE>(blue, green, red, firstPixel + pixelIndex);
+        *pal8Row++ = indexMin;
 
-            /*
-            Color Quantization - Fit the source color into the closest possible fit within the given palette.
-            Hu, Yu-Chen & Su, B.-H. (2008). Accelerated pixel mapping scheme for colour image quantisation.
-            Imaging Science Journal, The. 56. 68-78. 10.1179/174313107X214231.
-            */
+        calculateError(blue, green, red, pixelIndex, indexMin, rightError, nextErrorRow);
+
+        if (progress != nullptr) progress->store(pixelIndex + 1, memory_order_release);
+    } // End pixel
+}
 
-            int predIndex = indexLUT[intClamp((red + green + blue)/3,0,255)]; // Find the predicted index for the closest palette color using mean
+// Adds the BGRA colors of pixels [firstPixel, lastPixel) to their error entries, 8 pixels per SSE2 instruction
+void FastPixelMap::addIncomingError(const uint8_t *imageRow, int16_t *errorRow, int firstPixel, int lastPixel) {
+
+    int16_t *blues = errorRow;
+    int16_t *greens = errorRow + errorPlaneSize;
+    int16_t *reds = errorRow + 2*errorPlaneSize;
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+
+    int pixelIndex = firstPixel;
+    for (; pixelIndex + 8 <= lastPixel; pixelIndex += 8) {
+        __m128i low = _mm_loadu_si128((const __m128i *)(imageRow + pixelIndex*4));
+        __m128i high = _mm_loadu_si128((const __m128i *)(imageRow + pixelIndex*4 + 16));
+        __m128i pixelBlue = _mm_packs_epi32(_mm_and_si128(low, byteMask), _mm_and_si128(high, byteMask));
+        __m128i pixelGreen = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 8), byteMask), _mm_and_si128(_mm_srli_epi32(high, 8), byteMask));
+        __m128i pixelRed = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 16), byteMask), _mm_and_si128(_mm_srli_epi32(high, 16), byteMask));
+        _mm_storeu_si128((__m128i *)(blues + pixelIndex), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(blues + pixelIndex)), pixelBlue));
+        _mm_storeu_si128((__m128i *)(greens + pixelIndex), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(greens + pixelIndex)), pixelGreen));
+        _mm_storeu_si128((__m128i *)(reds + pixelIndex), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(reds + pixelIndex)), pixelRed));
+    }
+    for (; pixelIndex < lastPixel; pixelIndex++) {
+        blues[pixelIndex] += imageRow[pixelIndex*4];
+        greens[pixelIndex] += imageRow[pixelIndex*4+1];
+        reds[pixelIndex] += imageRow[pixelIndex*4+2];
+    }
+}
 
-            int sedMin = sed(blue, green, red, palette + predIndex*PIXEL_SIZE_IN_BYTES);
-            int indexMin = predIndex;
+// Splits the frame into one band of rows per frame thread. Rows don't depend on each other, so no syncing is needed.
+void FastPixelMap::convertImageOrdered(uint8_t *image, uint8_t *pal8Image) {
 
-            int downIndex = indexMin;
-            int upIndex = indexMin;
+    int threadCount = min(frameThreads, imageHeight);
+    auto runRows = [&](int band) {
+        int firstRow = imageHeight * band / threadCount;
+        int lastRow = imageHeight * (band+1) / threadCount;
+        for (int heightIndex = firstRow; heightIndex < lastRow; heightIndex++) {
+            convertRowOrdered(image + rowOffset(heightIndex), pal8Image + heightIndex*imageWidth, heightIndex, 0, imageWidth, ditheredRows + band*4*imageWidth);
+        }
+    };
+
+    runOnFrameThreads(threadCount, runRows);
+}
+
+// Runs job(frameThread) for frame threads 0 to threadCount-1 at once and returns when all of them are done. The wavefront
+// needs its rows to run side by side, so the helpers are real threads, not tasks that might wait for a free worker.
+void FastPixelMap::runOnFrameThreads(int threadCount, const function<void(int)> &job) {
+    threadCount = min(threadCount, (int) helperThreads.size() + 1);
+    if (threadCount > 1) {
+        lock_guard<mutex> lock(helperMutex);
+        helperJob = &job;
+        helperJobThreads = threadCount;
+        helpersRunning = threadCount - 1;
+        helperGeneration++;
+    }
+    helperStart.notify_all();
+    job(0);
+    unique_lock<mutex> lock(helperMutex);
+    helperDone.wait(lock, [this]() { return helpersRunning == 0; });
+}
+
+void FastPixelMap::runHelper(int frameThread, int generation) {
+    unique_lock<mutex> lock(helperMutex);
+    while (true) {
+        helperStart.wait(lock, [this, generation]() { return isStoppingHelpers || helperGeneration != generation; });
+        if (isStoppingHelpers) return;
+        generation = helperGeneration;
+        if (frameThread >= helperJobThreads) continue; // Fewer rows or tiles than frame threads
+        lock.unlock();
+        (*helperJob)(frameThread);
+        lock.lock();
+        if (--helpersRunning == 0) helperDone.notify_one();
+    }
+}
+
+void FastPixelMap::stopHelpers() {
+    {
+        lock_guard<mutex> lock(helperMutex);
+        isStoppingHelpers = true;
+    }
+    helperStart.notify_all();
+    for (auto& helper : helperThreads) {
+        helper.join();
+    }
+    helperThreads.clear();
+    isStoppingHelpers = false;
+}
+
+// Adds the threshold map's offsets to pixelCount pixels of a row, from firstColumn on, and maps them.
+// ditheredRow is scratch space for imageWidth BGRA pixels.
+template <bool USE_LUT, FastPixelMap::SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+void FastPixelMap::convertRowOrderedKernel(uint8_t *imageRow, uint8_t *pal8Row, int heightIndex, int firstColumn, int pixelCount, uint8_t *ditheredRow) {
+
+    // Every pixel is independent, so without a LUT the whole row goes through the SIMD kernel at once
+    const bool isRowSearch = !USE_LUT && SEARCH == SearchMethod::Vector;
+    const int8_t *offsets = thresholdMap->row(heightIndex);
+    int mask = thresholdMap->getSize() - 1;
+    const uint8_t *pixel = imageRow + firstColumn*PIXEL_SIZE_IN_BYTES;
+    uint8_t *dithered = ditheredRow + firstColumn*PIXEL_SIZE_IN_BYTES;
+
+    for (int i = firstColumn; i < firstColumn + pixelCount; i++, pixel += PIXEL_SIZE_IN_BYTES) {
+        int offset = offsets[i & mask];
+        int blue = intClamp(pixel[0] + offset, 0, 255);
+        int green = intClamp(pixel[1] + offset, 0, 255);
+        int red = intClamp(pixel[2] + offset, 0, 255);
+
+        if (isRowSearch) {
+            *dithered++ = blue;
+            *dithered++ = green;
+            *dithered++ = red;
+            dithered++;
+        } else {
+            pal8Row[i] = findIndex<USE_LUT, SEARCH, PALETTE_SIZE, TEMPORAL_REUSE>(blue, green, red, heightIndex*imageWidth + i);
+        }
+    }
+
+    if (isRowSearch) {
+        paletteSearch.findClosestRow(ditheredRow + firstColumn*PIXEL_SIZE_IN_BYTES, pixelCount, pal8Row + firstColumn);
+    }
+}
+
+// Deals the tiles out to the frame threads. Tiles never depend on each other in this mode, so no syncing is needed.
+void FastPixelMap::convertImageTiled(uint8_t *image, uint8_t *pal8Image) {
+
+    int tilesAcross = (imageWidth + STATIC_TILE_SIZE - 1) / STATIC_TILE_SIZE;
+    int tileCount = tilesAcross * ((imageHeight + STATIC_TILE_SIZE - 1) / STATIC_TILE_SIZE);
+    int threadCount = min(frameThreads, tileCount);
+    auto runTiles = [&](int frameThread) {
+        for (int tile = frameThread; tile < tileCount; tile += threadCount) {
+            convertTile(image, pal8Image, tile % tilesAcross, tile / tilesAcross, frameThread);
+        }
+    };
+
+    runOnFrameThreads(threadCount, runTiles);
+    hasPreviousFrame = true;
+}
+
+// Copies the last pal8 output if the tile's pixels are unchanged, otherwise remembers the new pixels and maps them
+void FastPixelMap::convertTile(uint8_t *image, uint8_t *pal8Image, int tileX, int tileY, int frameThread) {
+
+    int firstColumn = tileX * STATIC_TILE_SIZE;
+    int firstRow = tileY * STATIC_TILE_SIZE;
+    int tileWidth = min(STATIC_TILE_SIZE, imageWidth - firstColumn);
+    int tileHeight = min(STATIC_TILE_SIZE, imageHeight - firstRow);
+
+    bool isStatic = hasPreviousFrame;
+    for (int y = firstRow; y < firstRow + tileHeight && isStatic; y++) {
+        isStatic = memcmp(image + rowOffset(y) + firstColumn*4, previousImage + (y*imageWidth + firstColumn)*4, tileWidth*4) == 0;
+    }
+    if (isStatic) {
+        for (int y = firstRow; y < firstRow + tileHeight; y++) {
+            memcpy(pal8Image + y*imageWidth + firstColumn, previousPal8Image + y*imageWidth + firstColumn, tileWidth);
+        }
+        return;
+    }
+
+    int errorRowSize = 3*errorPlaneSize;
+    int16_t *currentErrorRow = tileErrorRows + frameThread*2*errorRowSize;
+    int16_t *nextErrorRow = currentErrorRow + errorRowSize;
+    fill(currentErrorRow, currentErrorRow + errorRowSize, 0); // Top row of the tile has no incoming error
+    for (int y = firstRow; y < firstRow + tileHeight; y++) {
+        uint8_t *imageRow = image + rowOffset(y);
+        uint8_t *pal8Row = pal8Image + y*imageWidth;
+        if (ditherMethod == DitherMethod::SierraLite) {
+            convertRow(imageRow + firstColumn*4, pal8Row + firstColumn, y*imageWidth + firstColumn, tileWidth, currentErrorRow, nextErrorRow, nullptr, nullptr);
+            swap(currentErrorRow, nextErrorRow);
+        } else {
+            convertRowOrdered(imageRow, pal8Row, y, firstColumn, tileWidth, ditheredRows + frameThread*4*imageWidth);
+        }
+        memcpy(previousImage + (y*imageWidth + firstColumn)*4, imageRow + firstColumn*4, tileWidth*4);
+        memcpy(previousPal8Image + y*imageWidth + firstColumn, pal8Row + firstColumn, tileWidth);
+    }
+}
 
-            bool down = (indexMin >= paletteSize-1) ? false : true;
-            bool up = (indexMin <= 0) ? false : true;
-            while (up || down) {
+// Closest palette index to an already clamped color. pixelIndex is only used for temporal reuse.
+template <bool USE_LUT, FastPixelMap::SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+inline int FastPixelMap::findIndex(int blue, int green, int red, int pixelIndex) {
 
-                if (down) { // check below predicted index (below = further in array)
-                        downIndex++;
-                    if ( downIndex >= paletteSize ) {
-                        down = false;
-                    } else if ( (3 * sedMin) < ssd(blue, green, red, palette+downIndex*4) )  {
-                        down = false;
-                    } else if ( (4 * sedMin) < paletteDistanceLUT[indexMin*paletteSize + downIndex] ) {
-                        // This color is rejected using the triangular inequality rule
+    if (USE_LUT) return colorLUT->lookup(blue, green, red); // Already as cheap as the reuse check
 
-                    } else {
+    if (TEMPORAL_REUSE) {
+        uint32_t color = blue | green << 8 | red << 16;
+        int previousIndex = previousIndices[pixelIndex];
+        if (color == previousColors[pixelIndex]) return previousIndex;
+        previousColors[pixelIndex] = color;
+        // Closer to palette color p than half the distance between p and its closest neighbour means closer to p than to
+        // any other palette color (triangle inequality), so the search would find p again
+        if (4 * sed(blue, green, red, palette + previousIndex*PIXEL_SIZE_IN_BYTES) < reuseDistanceLUT[previousIndex]) return previousIndex;
+    }
+
+    int indexMin;
+    if (SEARCH == SearchMethod::Vector) {
+        indexMin = paletteSearch.findClosest(blue, green, red);
+    } else {
+        indexMin = mpsSearchKernel<PALETTE_SIZE>(blue, green, red);
+    }
+    if (TEMPORAL_REUSE) previousIndices[pixelIndex] = indexMin;
+    return indexMin;
+}
+
+template <bool USE_LUT, FastPixelMap::SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+void FastPixelMap::setKernels() {
+    sierraRowKernel = &FastPixelMap::convertRowKernel<USE_LUT, SEARCH, PALETTE_SIZE, TEMPORAL_REUSE>;
+    orderedRowKernel = &FastPixelMap::convertRowOrderedKernel<USE_LUT, SEARCH, PALETTE_SIZE, TEMPORAL_REUSE>;
+}
+
+// Full palettes get MPS kernels with the palette size built in. A LUT answers before reuse or search would run.
+// Temporal reuse is left out with MPS, see setTemporalReuse.
+void FastPixelMap::selectKernels() {
+    if (colorLUT != nullptr) {
+        setKernels<true, SearchMethod::MPS, 0, false>();
+    } else if (searchMethod == SearchMethod::Vector) {
+        if (isTemporalReuse) setKernels<false, SearchMethod::Vector, 0, true>();
+        else setKernels<false, SearchMethod::Vector, 0, false>();
+    } else if (paletteSize == 256) {
+        setKernels<false, SearchMethod::MPS, 256, false>();
+    } else {
+        setKernels<false, SearchMethod::MPS, 0, false>();
+    }
+}
+
+int FastPixelMap::rowOffset(int heightIndex) {
+    return imageLinesize*heightIndex;
+}
+
+int FastPixelMap::defaultLinesize() {
+    int padCount = (ALIGNMENT-(imageWidth%ALIGNMENT))%ALIGNMENT; // padCount in terms of pixels
+    if (isPadded) return (imageWidth+padCount)*PIXEL_SIZE_IN_BYTES;
+    return imageWidth*PIXEL_SIZE_IN_BYTES;
+}
+
+void FastPixelMap::setFrameThreads(int frameThreads) {
+    if (frameThreads < 1) frameThreads = 1;
+    delete[] wavefrontErrorRows;
+    delete[] rowProgress;
+    delete[] ditheredRows;
+    wavefrontErrorRows = nullptr;
+    rowProgress = nullptr;
+    this->frameThreads = frameThreads;
+    ditheredRows = new uint8_t[frameThreads * 4*imageWidth];
+    if (isStaticTiles) setStaticTiles(true); // Error rows for the new thread count
+    if (frameThreads > 1) {
+        wavefrontErrorRows = new int16_t[(frameThreads+1) * 3*errorPlaneSize];
+        rowProgress = new atomic<int>[imageHeight];
+    }
+    stopHelpers();
+    for (int i = 1; i < frameThreads; i++) {
+        helperThreads.emplace_back(&FastPixelMap::runHelper, this, i, helperGeneration);
+    }
+}
+
+void FastPixelMap::setTemporalReuse(bool isTemporalReuse) {
+    this->isTemporalReuse = isTemporalReuse;
+    delete[] previousColors;
+    delete[] previousIndices;
+    previousColors = nullptr;
+    previousIndices = nullptr;
+    if (isTemporalReuse) {
+        previousColors = new uint32_t[imageWidth*imageHeight];
+        previousIndices = new uint8_t[imageWidth*imageHeight]();
+        fill(previousColors, previousColors + imageWidth*imageHeight, 0xFFFFFFFF);
+    }
+    selectKernels();
+}
+
+void FastPixelMap::setStaticTiles(bool isStaticTiles) {
+    this->isStaticTiles = isStaticTiles;
+    hasPreviousFrame = false;
+    delete[] previousImage;
+    delete[] previousPal8Image;
+    delete[] tileErrorRows;
+    previousImage = nullptr;
+    previousPal8Image = nullptr;
+    tileErrorRows = nullptr;
+    if (isStaticTiles) {
+        previousImage = new uint8_t[4*imageWidth*imageHeight];
+        previousPal8Image = new uint8_t[imageWidth*imageHeight];
+        tileErrorRows = new int16_t[frameThreads * 2*3*errorPlaneSize];
+    }
+}
+
+void FastPixelMap::setDitherMethod(DitherMethod ditherMethod) {
+    this->ditherMethod = ditherMethod;
+    hasPreviousFrame = false; // Tiles kept from the last frame were dithered differently
+    if (ditherMethod == DitherMethod::Bayer) thresholdMap = &ThresholdMap::bayer();
+    else if (ditherMethod == DitherMethod::BlueNoise) thresholdMap = &ThresholdMap::blueNoise();
+    else thresholdMap = nullptr;
+}
+
+// Returns the index of the closest palette color to the given (already clamped) color.
+int FastPixelMap::mpsSearch(int blue, int green, int red) {
+    if (paletteSize == 256) return mpsSearchKernel<256>(blue, green, red);
+    return mpsSearchKernel<0>(blue, green, red);
+}
+
+// PALETTE_SIZE is paletteSize, or 0 when it is only known at runtime
+template <int PALETTE_SIZE>
+int FastPixelMap::mpsSearchKernel(int blue, int green, int red) {
+
+    const int paletteSize = (PALETTE_SIZE > 0) ? PALETTE_SIZE : this->paletteSize;
+
+    /*
+    Color Quantization - Fit the source color into the closest possible fit within the given palette.
+    Hu, Yu-Chen & Su, B.-H. (2008). Accelerated pixel mapping scheme for colour image quantisation.
+    Imaging Science Journal, The. 56. 68-78. 10.1179/174313107X214231.
+    */
+
+    int predIndex = indexLUT[intClamp((red + green + blue)/3,0,255)]; // Find the predicted index for the closest palette color using mean
+
+    int sedMin = sed(blue, green, red, palette + predIndex*PIXEL_SIZE_IN_BYTES);
+    int indexMin = predIndex;
+
+    int downIndex = indexMin;
+    int upIndex = indexMin;
+
+    bool down = (indexMin >= paletteSize-1) ? false : true;
+    bool up = (indexMin <= 0) ? false : true;
+    while (up || down) {
+
+        if (down) { // check below predicted index (below = further in array)
+                downIndex++;
+            if ( downIndex >= paletteSize ) {
+                down = false;
+            } else if ( (3 * sedMin) < ssd(blue, green, red, palette+downIndex*4) )  {
+                down = false;
+            } else if ( (4 * sedMin) < paletteDistanceLUT[indexMin*paletteSize + downIndex] ) {
+                // This color is rejected using the triangular inequality rule
+
+            } else {
 //                        int testSed = sed(blue, green, red, palette+downIndex*4);
 //                        if (testSed < sedMin) {
 //                            sedMin = testSed;
 //                            indexMin = downIndex;
 //                        }
-                        // Partial distance search technique
-                        // Only testing after adding the blue and green channels, as there was not significant speed-up when checking for each channel.
-                        int testSed = (blue - palette[downIndex*4]) * (blue - palette[downIndex*4]);
+                // Partial distance search technique
+                // Only testing after adding the blue and green channels, as there was not significant speed-up when checking for each channel.
+                int testSed = (blue - palette[downIndex*4]) * (blue - palette[downIndex*4]);
+                if (testSed < sedMin) {
+                    testSed += (green - palette[downIndex*4+1]) * (green - palette[downIndex*4+1]);
+                    if (testSed < sedMin) {
+                        testSed += (red - palette[downIndex*4+2]) * (red - palette[downIndex*4+2]);
                         if (testSed < sedMin) {
-                            testSed += (green - palette[downIndex*4+1]) * (green - palette[downIndex*4+1]);
-                            if (testSed < sedMin) {
-                                testSed += (red - palette[downIndex*4+2]) * (red - palette[downIndex*4+2]);
-                                if (testSed < sedMin) {
-                                    sedMin = testSed;
-                                    indexMin = downIndex;
-                                }
-                            }
+                            sedMin = testSed;
+                            indexMin = downIndex;
                         }
                     }
                 }
+            }
+        }
 
-                if (up) { // check above predicted index (above = before in array)
-                    upIndex--;
-                    if ( upIndex < 0 ) {
-                        up = false;
-                    } else if ( (3 * sedMin) < ssd(blue, green, red, palette+upIndex*4) ) {
-                        up = false;
-                    } else  if ( (4 * sedMin) < paletteDistanceLUT[indexMin*paletteSize + upIndex] ) {
+        if (up) { // check above predicted index (above = before in array)
+            upIndex--;
+            if ( upIndex < 0 ) {
+                up = false;
+            } else if ( (3 * sedMin) < ssd(blue, green, red, palette+upIndex*4) ) {
+                up = false;
+            } else  if ( (4 * sedMin) < paletteDistanceLUT[indexMin*paletteSize + upIndex] ) {
 
-                        // This color is rejected using the triangular inequality rule
+                // This color is rejected using the triangular inequality rule
 
-                    } else {
+            } else {
 //                        int testSed = sed(blue, green, red, palette+upIndex*4);
 //                        if (testSed < sedMin) {
 //                            sedMin = testSed;
 //                            indexMin = upIndex;
 //                        }
-                        int testSed = (blue - palette[upIndex*4]) * (blue - palette[upIndex*4]);
+                int testSed = (blue - palette[upIndex*4]) * (blue - palette[upIndex*4]);
+                if (testSed < sedMin) {
+                    testSed += (green - palette[upIndex*4+1]) * (green - palette[upIndex*4+1]);
+                    if (testSed < sedMin) {
+                        testSed += (red - palette[upIndex*4+2]) * (red - palette[upIndex*4+2]);
                         if (testSed < sedMin) {
-                            testSed += (green - palette[upIndex*4+1]) * (green - palette[upIndex*4+1]);
-                            if (testSed < sedMin) {
-                                testSed += (red - palette[upIndex*4+2]) * (red - palette[upIndex*4+2]);
-                                if (testSed < sedMin) {
-                                    sedMin = testSed;
-                                    indexMin = upIndex;
-                                }
-                            }
+                            sedMin = testSed;
+                            indexMin = upIndex;
                         }
                     }
+                }
+            }
 
-                } // End up/down if-blocks
-            } // End while (up or down) - Done checking every eligible color
-            pal8Image[heightIndex*imageWidth+widthIndex/PIXEL_SIZE_IN_BYTES] = indexMin;
-            offset+=PIXEL_SIZE_IN_BYTES;
-
-            int diff = predIndex - indexMin;
-            diffSum += diff;
-            //if (abs(diff) < 10 || true) cout << "x: " << widthIndex << ", y: " << heightIndex <<  ", redErr: " << colorErrorRow1[widthIndex+2] << ", greenErr: " << colorErrorRow1[widthIndex+1] << ", blueErr: " << colorErrorRow1[widthIndex] << endl;
-            //else cout << "x: " << widthIndex << ", y: " << heightIndex << "pred: " << predIndex << ", min: " << indexMin << ", diff: " << diff << " XXXXXX" << endl;
-
-            calculateError(blue, green, red, widthIndex, indexMin);
-            //calculateError(rawBlue, rawGreen, rawRed, widthIndex, indexMin);
-
-        } // End pixel
-
-        if (isPadded) {
-            offset += padCount*PIXEL_SIZE_IN_BYTES;
-        }
-
-        swapArrays();
-    } // End row
-
-    //cout << "diffSum: " << diffSum << endl;
-
-    fill(colorErrorRow1,colorErrorRow1+4*imageWidth+4, 0);
-    fill(colorErrorRow2,colorErrorRow2+4*imageWidth+4, 0);
-
-    return pal8Image;
+        } // End up/down if-blocks
+    } // End while (up or down) - Done checking every eligible color
+    return indexMin;
 }
 
-void FastPixelMap::calculateError(int blue, int green, int red, int widthIndex, int indexMin) {
+// rightError receives the half error for the next pixel in the row. The quarter errors for the row below overwrite
+// the entry under this pixel (the first error it receives) and add to the one down and to the left.
+void FastPixelMap::calculateError(int blue, int green, int red, int pixelIndex, int indexMin, int *rightError, int16_t *nextErrorRow) {
     // Calculate and add error to neighboring pixels.
     int blueError = (blue - palette[indexMin*4]);
     int greenError = (green - palette[indexMin*4+1]);
@@ -231,30 +589,32 @@ void FastPixelMap::calculateError(int blue, int green, int red, int widthIndex,
     greenError >>= 1;
     redError >>= 1;
 
-    // Add half error to right pixel
-    colorErrorRow1[widthIndex+4] += blueError;
-    colorErrorRow1[widthIndex+5] += greenError;
-    colorErrorRow1[widthIndex+6] += redError;
+    // Half error to right pixel
+    rightError[0] = blueError;
+    rightError[1] = greenError;
+    rightError[2] = redError;
     // Half errors again
     blueError >>= 1;
     greenError >>= 1;
     redError >>= 1;
+    int16_t *nextBlues = nextErrorRow;
+    int16_t *nextGreens = nextErrorRow + errorPlaneSize;
+    int16_t *nextReds = nextErrorRow + 2*errorPlaneSize;
     // Add quarter error to bottom-left pixel
-    if (widthIndex != 0) {
-        colorErrorRow2[widthIndex-4] += blueError;
-        colorErrorRow2[widthIndex-3] += greenError;
-        colorErrorRow2[widthIndex-2] += redError;
+    if (pixelIndex != 0) {
+        nextBlues[pixelIndex-1] += blueError;
+        nextGreens[pixelIndex-1] += greenError;
+        nextReds[pixelIndex-1] += redError;
     }
-    // Add quarter error to bottom pixel
-    colorErrorRow2[widthIndex] += blueError;
-    colorErrorRow2[widthIndex+1] += greenError;
-    colorErrorRow2[widthIndex+2] += redError;
+    // Quarter error to bottom pixel
+    nextBlues[pixelIndex] = blueError;
+    nextGreens[pixelIndex] = greenError;
+    nextReds[pixelIndex] = redError;
 }
 
+// Rotates the error rows. No clearing needed, convertRow overwrites the next row.
 void FastPixelMap::swapArrays() {
-    fill(colorErrorRow1,colorErrorRow1+4*imageWidth+4, 0);
-        //memset(colorErrorRow1,0,16*imageWidth+16);
-    int* tempRow1 = colorErrorRow1;
+    int16_t* tempRow1 = colorErrorRow1;
     colorErrorRow1 = colorErrorRow2;
     colorErrorRow2 = tempRow1;
 }
@@ -306,6 +666,16 @@ bool FastPixelMap::initializePaletteDistanceLUT() {
     return true;
 }
 
+void FastPixelMap::initializeReuseDistanceLUT() {
+    for (int i = 0; i < paletteSize; i++) {
+        int distanceMin = INT_MAX;
+        for (int j = 0; j < paletteSize; j++) {
+            if (j != i) distanceMin = min(distanceMin, paletteDistanceLUT[paletteSize*i+j]);
+        }
+        reuseDistanceLUT[i] = distanceMin; // 0 for duplicate colors, which are then never reused
+    }
+}
+
 int FastPixelMap::sed(uint8_t *colorA, uint8_t *colorB) {
     return ((colorA[0] - colorB[0]) * (colorA[0] - colorB[0]) + (colorA[1] - colorB[1]) * (colorA[1] - colorB[1]) + (colorA[2] - colorB[2]) * (colorA[2] - colorB[2]));
 }
@@ -2,11 +2,22 @@
 #define FASTPIXELMAP_HPP_INCLUDED
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "colorlut.hpp"
+#include "palettesearch.hpp"
+#include "thresholdmap.hpp"
 
 #ifndef ALIGNMENT
 #define ALIGNMENT 64
 #endif
 
+#define STATIC_TILE_SIZE 16 // Pixels per side of the tiles compared by static tile detection
+
 struct BGRAPixel {
     uint8_t blue;
     uint8_t green;
@@ -28,32 +39,104 @@ int displayPalette(uint8_t *palette, int paletteSize);
 class FastPixelMap {
 
 public:
-    FastPixelMap(uint8_t *palette, int paletteSize, int imageWidth, int imageHeight, bool isPadded) {
+    // MPS is the reference implementation. Vector does an exhaustive SIMD search. It can differ from MPS on ties, and on the
+    // rare colors where MPS's early termination stops before the true closest color, so dithered output is not byte-identical.
+    enum class SearchMethod { MPS, Vector };
+    // SierraLite diffuses error to the pixels right and below, so a change anywhere can ripple through the rest of the frame.
+    // Bayer and BlueNoise are ordered dithers. Each pixel only depends on its own color and position, so static content
+    // stays identical from frame to frame, and rows can be mapped in any order.
+    enum class DitherMethod { SierraLite, Bayer, BlueNoise };
+
+    FastPixelMap(uint8_t *palette, int paletteSize, int imageWidth, int imageHeight, bool isPadded) : paletteSearch(palette, paletteSize) {
         this->palette = palette;
         this->paletteSize = paletteSize;
+        colorLUT = nullptr;
+        searchMethod = SearchMethod::MPS;
+        ditherMethod = DitherMethod::SierraLite;
+        thresholdMap = nullptr;
         // (1) Sort palette by mean value
         meanPaletteLUT = new uint8_t[paletteSize];
         if (!initializeMeanPaletteLUT()) std::cerr << "Failed to initialize Mean Palette LUT" << std::endl;
         if (!initializeIndexLUT()) std::cerr << "Failed to initialize Index LUT or your palette does not have white as a color!" << std::endl;
         paletteDistanceLUT = new int[paletteSize*paletteSize];
         if (!initializePaletteDistanceLUT()) std::cerr << "Failed to initialize Palette Distance LUT!" << std::endl;
+        reuseDistanceLUT = new int[paletteSize];
+        initializeReuseDistanceLUT();
 
         this->imageWidth = imageWidth;
         this->imageHeight = imageHeight;
         this->isPadded = isPadded;
 
-        colorErrorRow1 = new int[4*imageWidth+4](); // Allocate extra pixel to avoid needing to check for overflow
-        colorErrorRow2 = new int[4*imageWidth+4](); // Allocate extra pixel to avoid needing to check for overflow
+        errorPlaneSize = (imageWidth + 7) & ~7; // Whole SSE2 vectors
+        colorErrorRow1 = new int16_t[3*errorPlaneSize]();
+        colorErrorRow2 = new int16_t[3*errorPlaneSize]();
+
+        frameThreads = 1;
+        helperJob = nullptr;
+        helperJobThreads = 0;
+        helperGeneration = 0;
+        helpersRunning = 0;
+        isStoppingHelpers = false;
+        wavefrontErrorRows = nullptr;
+        rowProgress = nullptr;
+        ditheredRows = new uint8_t[4*imageWidth];
+
+        isTemporalReuse = false;
+        previousColors = nullptr;
+        previousIndices = nullptr;
+
+        isStaticTiles = false;
+        hasPreviousFrame = false;
+        previousImage = nullptr;
+        previousPal8Image = nullptr;
+        tileErrorRows = nullptr;
+
+        selectKernels();
     }
     uint8_t* convertImage(uint8_t *image);
+    void convertImage(uint8_t *image, uint8_t *pal8Image);
+    void convertImage(uint8_t *image, int linesize, uint8_t *pal8Image);
     uint8_t* fullSearchConvertImage(uint8_t *image, int imageWidth, int imageHeight, bool isPadded);
 
+    // MPS + PDS + TIE search for a single color. Channels must already be clamped to [0, 255].
+    int mpsSearch(int blue, int green, int red);
+
+    // Optional precomputed color->index table. Must be built from the same palette. Not owned by FastPixelMap.
+    void setColorLUT(const ColorLUT *colorLUT) { this->colorLUT = colorLUT; selectKernels(); }
+    // Search used by convertImage when there is no color LUT
+    void setSearchMethod(SearchMethod searchMethod) { this->searchMethod = searchMethod; selectKernels(); }
+    void setDitherMethod(DitherMethod ditherMethod);
+    // Number of threads convertImage uses for a single frame. Sierra Lite rows are dithered as a wavefront, ordered dither
+    // splits the frame into bands. Output is unchanged either way. Starts frameThreads-1 helper threads that stay with this
+    // mapper, so callers running several mappers at once should keep mappers x frameThreads within the core count.
+    void setFrameThreads(int frameThreads);
+    // Remembers every pixel's searched color and palette index, and skips the search when the pixel's next color is the
+    // same or still provably closest to the same palette color. Frames don't need to arrive in order, any earlier frame
+    // is just a guess. Only used with Vector search, whose result is the true closest color and so the same with or
+    // without reuse. MPS can stop early at a different color, so with reuse the output would depend on which frames
+    // this mapper saw before, and a pipeline with one mapper per worker wouldn't give the same file twice.
+    void setTemporalReuse(bool isTemporalReuse);
+    // Splits frames into STATIC_TILE_SIZE tiles and only maps the tiles whose BGRA pixels differ from this mapper's last
+    // frame. The rest keep their last pal8 output. Sierra Lite error stops at tile edges so that every tile only depends on
+    // its own pixels, which changes the dither pattern slightly. Ordered dither output is unchanged.
+    void setStaticTiles(bool isStaticTiles);
+
     ~FastPixelMap() {
 
+        stopHelpers();
         delete[] meanPaletteLUT;
         delete[] paletteDistanceLUT;
         delete[] colorErrorRow1;
         delete[] colorErrorRow2;
+        delete[] wavefrontErrorRows;
+        delete[] rowProgress;
+        delete[] ditheredRows;
+        delete[] reuseDistanceLUT;
+        delete[] previousColors;
+        delete[] previousIndices;
+        delete[] previousImage;
+        delete[] previousPal8Image;
+        delete[] tileErrorRows;
 
     }
 
@@ -65,11 +148,62 @@ private:
     int imageHeight;
     bool isPadded;
 
-    void calculateError(int blue, int green, int red, int widthIndex, int indexMin);
-    int * colorErrorRow1;
-    int * colorErrorRow2;
+    const ColorLUT *colorLUT;
+    PaletteSearch paletteSearch;
+    SearchMethod searchMethod;
+    DitherMethod ditherMethod;
+    const ThresholdMap *thresholdMap; // Only set for ordered dithering
+
+    // Sierra Lite error rows are int16 planes of blue, green and red, errorPlaneSize entries each. Error sent right is
+    // carried in registers, so a row only ever receives error from the row above.
+    int errorPlaneSize;
+    void calculateError(int blue, int green, int red, int pixelIndex, int indexMin, int *rightError, int16_t *nextErrorRow);
+    void addIncomingError(const uint8_t *imageRow, int16_t *errorRow, int firstPixel, int lastPixel);
+    int16_t * colorErrorRow1;
+    int16_t * colorErrorRow2;
     void swapArrays();
 
+    void convertRow(uint8_t *imageRow, uint8_t *pal8Row, int firstPixel, int pixelCount, int16_t *currentErrorRow, int16_t *nextErrorRow,
+                    const std::atomic<int> *previousRowProgress, std::atomic<int> *progress) {
+        (this->*sierraRowKernel)(imageRow, pal8Row, firstPixel, pixelCount, currentErrorRow, nextErrorRow, previousRowProgress, progress);
+    }
+    int rowOffset(int heightIndex);
+    int defaultLinesize();
+    int imageLinesize; // Bytes between rows of the image being converted
+
+    int frameThreads;
+    int16_t * wavefrontErrorRows; // Ring of frameThreads+1 error rows
+    std::atomic<int> * rowProgress; // Pixels finished per row
+    void convertImageWavefront(uint8_t *image, uint8_t *pal8Image);
+
+    // Frame thread 0 is the caller of convertImage, the others are helpers waiting here between frames
+    std::vector<std::thread> helperThreads;
+    std::mutex helperMutex;
+    std::condition_variable helperStart;
+    std::condition_variable helperDone;
+    const std::function<void(int)> *helperJob;
+    int helperJobThreads; // Frame threads taking part in the current job
+    int helperGeneration; // Bumped for every job
+    int helpersRunning;
+    bool isStoppingHelpers;
+    void runOnFrameThreads(int threadCount, const std::function<void(int)> &job);
+    void runHelper(int frameThread, int generation);
+    void stopHelpers();
+
+    uint8_t * ditheredRows; // One BGRA row per frame thread, fed to PaletteSearch::findClosestRow
+    void convertRowOrdered(uint8_t *imageRow, uint8_t *pal8Row, int heightIndex, int firstColumn, int pixelCount, uint8_t *ditheredRow) {
+        (this->*orderedRowKernel)(imageRow, pal8Row, heightIndex, firstColumn, pixelCount, ditheredRow);
+    }
+    void convertImageOrdered(uint8_t *image, uint8_t *pal8Image);
+
+    bool isStaticTiles;
+    bool hasPreviousFrame;
+    uint8_t *previousImage; // Unpadded BGRA copy of the last frame
+    uint8_t *previousPal8Image;
+    int16_t *tileErrorRows; // Two Sierra Lite error rows per frame thread
+    void convertImageTiled(uint8_t *image, uint8_t *pal8Image);
+    void convertTile(uint8_t *image, uint8_t *pal8Image, int tileX, int tileY, int frameThread);
+
     uint8_t *meanPaletteLUT;
     bool initializeMeanPaletteLUT();
 
@@ -79,6 +213,32 @@ private:
     int *paletteDistanceLUT;
     bool initializePaletteDistanceLUT();
 
+    bool isTemporalReuse;
+    uint32_t *previousColors; // Per pixel, packed BGR of the last searched color. Never matches before the first search.
+    uint8_t *previousIndices;
+    int *reuseDistanceLUT; // Per palette color, squared distance to its closest other palette color
+    void initializeReuseDistanceLUT();
+
+    // Row kernels compiled for one combination of color LUT, search method, palette size (0 for any) and temporal reuse,
+    // so the per pixel loop has no settings to branch on. selectKernels picks them whenever a setting changes.
+    typedef void (FastPixelMap::*SierraRowKernel)(uint8_t *imageRow, uint8_t *pal8Row, int firstPixel, int pixelCount, int16_t *currentErrorRow,
+                                                  int16_t *nextErrorRow, const std::atomic<int> *previousRowProgress, std::atomic<int> *progress);
+    typedef void (FastPixelMap::*OrderedRowKernel)(uint8_t *imageRow, uint8_t *pal8Row, int heightIndex, int firstColumn, int pixelCount, uint8_t *ditheredRow);
+    SierraRowKernel sierraRowKernel;
+    OrderedRowKernel orderedRowKernel;
+    void selectKernels();
+    template <bool USE_LUT, SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+    void setKernels();
+    template <bool USE_LUT, SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+    void convertRowKernel(uint8_t *imageRow, uint8_t *pal8Row, int firstPixel, int pixelCount, int16_t *currentErrorRow, int16_t *nextErrorRow,
+                          const std::atomic<int> *previousRowProgress, std::atomic<int> *progress);
+    template <bool USE_LUT, SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+    void convertRowOrderedKernel(uint8_t *imageRow, uint8_t *pal8Row, int heightIndex, int firstColumn, int pixelCount, uint8_t *ditheredRow);
+    template <bool USE_LUT, SearchMethod SEARCH, int PALETTE_SIZE, bool TEMPORAL_REUSE>
+    int findIndex(int blue, int green, int red, int pixelIndex);
+    template <int PALETTE_SIZE>
+    int mpsSearchKernel(int blue, int green, int red);
+
     int sed(uint8_t *colorA, uint8_t *colorB);
     int sed(int blue, int green, int red, uint8_t *colorB);
     int ssd(uint8_t *colorA, uint8_t *colorB);
@@ -0,0 +1,139 @@
+#include "frameindex.hpp"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+using namespace std;
+
+// Bump whenever the layout below changes, so old cache files are rebuilt instead of misread
+const uint32_t FRAME_INDEX_VERSION = 1;
+const char FRAME_INDEX_MAGIC[8] = {'C', 'C', 'V', 'P', 'I', 'D', 'X', '\0'};
+
+struct FrameIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t fileSize; // Of the movie, to notice when it was replaced
+    int64_t modificationTime;
+    uint64_t frameCount;
+    uint64_t keyframeCount;
+};
+
+
+bool FrameIndex::build(AVFormatContext * pFormatContext, int videoStreamIndex, const string &inputFileName, const string &cachePath) {
+
+    struct stat fileStats;
+    bool hasStats = stat(inputFileName.c_str(), &fileStats) == 0;
+    uint64_t fileSize = hasStats ? fileStats.st_size : 0;
+    int64_t modificationTime = hasStats ? fileStats.st_mtime : 0;
+    if (!cachePath.empty() && hasStats && load(cachePath, fileSize, modificationTime)) {
+        isBuilt = true;
+        return true;
+    }
+
+    framePts.clear();
+    keyframePts.clear();
+    AVPacket * pPacket = av_packet_alloc();
+    while (av_read_frame(pFormatContext, pPacket) >= 0) {
+        if (pPacket->stream_index == videoStreamIndex && pPacket->pts != AV_NOPTS_VALUE) {
+            framePts.push_back(pPacket->pts);
+            if (pPacket->flags & AV_PKT_FLAG_KEY) keyframePts.push_back(pPacket->pts);
+        }
+        av_packet_unref(pPacket);
+    }
+    av_packet_free(&pPacket);
+    // Packets come in decode order. With B-frames that isn't presentation order.
+    sort(framePts.begin(), framePts.end());
+    sort(keyframePts.begin(), keyframePts.end());
+    isBuilt = true;
+
+    if (cachePath.empty() || !hasStats) return true;
+    if (!save(cachePath, fileSize, modificationTime)) {
+        cerr << "FrameIndex: Could not save index to " << cachePath << endl;
+        return false;
+    }
+    return true;
+}
+
+size_t FrameIndex::frameAtOrAfter(int64_t pts) const {
+    return lower_bound(framePts.begin(), framePts.end(), pts) - framePts.begin();
+}
+
+int64_t FrameIndex::keyframeAtOrBefore(int64_t pts) const {
+    if (keyframePts.empty()) return pts;
+    auto next = upper_bound(keyframePts.begin(), keyframePts.end(), pts);
+    if (next == keyframePts.begin()) return keyframePts.front();
+    return *(next - 1);
+}
+
+bool FrameIndex::hasConstantFrameRate() const {
+    if (framePts.size() < 3) return true;
+    int64_t minGap = framePts[1] - framePts[0];
+    int64_t maxGap = minGap;
+    for (size_t i = 2; i < framePts.size(); i++) {
+        minGap = min(minGap, framePts[i] - framePts[i-1]);
+        maxGap = max(maxGap, framePts[i] - framePts[i-1]);
+    }
+    return maxGap - minGap <= 1;
+}
+
+bool FrameIndex::load(const string &cachePath, uint64_t fileSize, int64_t modificationTime) {
+    ifstream cacheFile(cachePath, ios::binary);
+    if (!cacheFile.is_open()) return false;
+
+    FrameIndexHeader header;
+    if (!cacheFile.read((char *) &header, sizeof(header))) return false;
+    if (!equal(header.magic, header.magic + 8, FRAME_INDEX_MAGIC) || header.version != FRAME_INDEX_VERSION
+        || header.fileSize != fileSize || header.modificationTime != modificationTime) {
+        return false;
+    }
+    // The counts must describe exactly the rest of the file, so a truncated or corrupt cache is rebuilt instead of
+    // being read partly or sizing a huge allocation
+    cacheFile.seekg(0, ios::end);
+    uint64_t dataSize = (uint64_t) cacheFile.tellg() - sizeof(header);
+    cacheFile.seekg(sizeof(header));
+    if (!cacheFile || header.frameCount > dataSize / sizeof(int64_t) || header.keyframeCount > header.frameCount
+        || (header.frameCount + header.keyframeCount) * sizeof(int64_t) != dataSize) {
+        return false;
+    }
+    framePts.resize(header.frameCount);
+    keyframePts.resize(header.keyframeCount);
+    if (!cacheFile.read((char *) framePts.data(), header.frameCount * sizeof(int64_t))
+        || !cacheFile.read((char *) keyframePts.data(), header.keyframeCount * sizeof(int64_t))
+        || !is_sorted(framePts.begin(), framePts.end()) || !is_sorted(keyframePts.begin(), keyframePts.end())) {
+        framePts.clear();
+        keyframePts.clear();
+        return false;
+    }
+    return true;
+}
+
+bool FrameIndex::save(const string &cachePath, uint64_t fileSize, int64_t modificationTime) {
+    // Written under a temporary name and renamed, so another process never reads half a file
+    string tempPath = cachePath + ".tmp." + to_string(getpid());
+    ofstream cacheFile(tempPath, ios::binary | ios::trunc);
+    if (!cacheFile.is_open()) return false;
+
+    FrameIndexHeader header = {};
+    copy(FRAME_INDEX_MAGIC, FRAME_INDEX_MAGIC + 8, header.magic);
+    header.version = FRAME_INDEX_VERSION;
+    header.fileSize = fileSize;
+    header.modificationTime = modificationTime;
+    header.frameCount = framePts.size();
+    header.keyframeCount = keyframePts.size();
+    cacheFile.write((const char *) &header, sizeof(header));
+    cacheFile.write((const char *) framePts.data(), framePts.size() * sizeof(int64_t));
+    cacheFile.write((const char *) keyframePts.data(), keyframePts.size() * sizeof(int64_t));
+    cacheFile.close();
+    if (!cacheFile || rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef FRAMEINDEX_HPP_INCLUDED
+#define FRAMEINDEX_HPP_INCLUDED
+#include <string>
+#include <vector>
+#include <cstdint>
+
+struct AVFormatContext;
+
+// Presentation timestamps of every frame and every keyframe of a video stream, in the stream's time base and in
+// presentation order. Built by reading through the container once without decoding anything.
+// When a cache path is given, the index is saved there and loaded on later runs, as long as the movie file's size and
+// modification time still match.
+class FrameIndex {
+
+public:
+    FrameIndex() {
+        isBuilt = false;
+    }
+
+    // Leaves the format context at the end of the file. Returns false if the cache was wanted but couldn't be written.
+    bool build(AVFormatContext * pFormatContext, int videoStreamIndex, const std::string &inputFileName, const std::string &cachePath);
+    bool isValid() const { return isBuilt; }
+
+    // Index of the first frame with a pts at or after pts, or getFrameCount() if there is none
+    size_t frameAtOrAfter(int64_t pts) const;
+    // Latest keyframe at or before pts. Falls back to the first keyframe.
+    int64_t keyframeAtOrBefore(int64_t pts) const;
+
+    size_t getFrameCount() const { return framePts.size(); }
+    // True when every frame comes the same number of ticks after the one before it, give or take one tick of rounding
+    bool hasConstantFrameRate() const;
+
+    std::vector<int64_t> framePts;
+    std::vector<int64_t> keyframePts;
+
+private:
+    bool isBuilt;
+
+    bool load(const std::string &cachePath, uint64_t fileSize, int64_t modificationTime);
+    bool save(const std::string &cachePath, uint64_t fileSize, int64_t modificationTime);
+
+};
+
+#endif // FRAMEINDEX_HPP_INCLUDED
@@ -0,0 +1,56 @@
+#include "framepool.hpp"
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+
+FrameBuffer & FrameBuffer::operator=(FrameBuffer &&other) noexcept {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        data = other.data;
+        other.pool = nullptr;
+        other.data = nullptr;
+    }
+    return *this;
+}
+
+void FrameBuffer::release() {
+    if (pool != nullptr && data != nullptr) pool->recycle(data);
+    pool = nullptr;
+    data = nullptr;
+}
+
+
+
+FramePool::~FramePool() {
+    for (uint8_t *buffer : allBuffers) {
+        free(buffer);
+    }
+}
+
+FrameBuffer FramePool::acquire() {
+    lock_guard<mutex> lock(poolMutex);
+    if (!freeBuffers.empty()) {
+        uint8_t *buffer = freeBuffers.back(); // Most recently used buffer is the most likely to still be in cache
+        freeBuffers.pop_back();
+        return FrameBuffer(this, buffer);
+    }
+
+    uint8_t *buffer = (uint8_t *) aligned_alloc(alignment, bufferSize);
+    if (buffer == nullptr) throw bad_alloc();
+    allBuffers.push_back(buffer);
+    freeBuffers.reserve(allBuffers.size()); // So recycle never allocates
+    return FrameBuffer(this, buffer);
+}
+
+void FramePool::recycle(uint8_t *data) {
+    lock_guard<mutex> lock(poolMutex);
+    freeBuffers.push_back(data);
+}
+
+size_t FramePool::getAllocationCount() {
+    lock_guard<mutex> lock(poolMutex);
+    return allBuffers.size();
+}
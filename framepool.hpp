@@ -0,0 +1,81 @@
+#ifndef FRAMEPOOL_HPP_INCLUDED
+#define FRAMEPOOL_HPP_INCLUDED
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#ifndef ALIGNMENT
+#define ALIGNMENT 64
+#endif
+
+class FramePool;
+
+// Handle to a buffer borrowed from a FramePool. Move-only, like unique_ptr.
+// The buffer goes back to its pool when the handle is destroyed or release() is called.
+class FrameBuffer {
+
+public:
+    FrameBuffer() {
+        pool = nullptr;
+        data = nullptr;
+    }
+    FrameBuffer(FramePool *pool, uint8_t *data) {
+        this->pool = pool;
+        this->data = data;
+    }
+    FrameBuffer(FrameBuffer &&other) noexcept {
+        pool = other.pool;
+        data = other.data;
+        other.pool = nullptr;
+        other.data = nullptr;
+    }
+    FrameBuffer & operator=(FrameBuffer &&other) noexcept;
+    FrameBuffer(const FrameBuffer &) = delete;
+    FrameBuffer & operator=(const FrameBuffer &) = delete;
+
+    ~FrameBuffer() {
+        release();
+    }
+
+    uint8_t *get() const { return data; }
+    explicit operator bool() const { return data != nullptr; }
+    void release();
+
+private:
+    FramePool *pool;
+    uint8_t *data;
+
+};
+
+
+// Recycling pool of equally sized, aligned buffers. Buffers are only allocated when every existing one is in use,
+// so once the pipeline reaches its steady state there are no more heap allocations or fresh page faults per frame.
+// Thread-safe. Every FrameBuffer must be released before the pool is destroyed.
+class FramePool {
+
+public:
+    FramePool(size_t bufferSize, size_t alignment = ALIGNMENT) {
+        this->alignment = alignment;
+        this->bufferSize = (bufferSize + alignment - 1) / alignment * alignment; // aligned_alloc needs a multiple of the alignment
+    }
+
+    ~FramePool();
+
+    FrameBuffer acquire();
+    size_t getBufferSize() const { return bufferSize; }
+    size_t getAllocationCount(); // Total buffers ever allocated by this pool
+
+private:
+    friend class FrameBuffer;
+    void recycle(uint8_t *data);
+
+    size_t bufferSize;
+    size_t alignment;
+    std::mutex poolMutex;
+    std::vector<uint8_t*> freeBuffers;
+    std::vector<uint8_t*> allBuffers;
+
+};
+
+#endif // FRAMEPOOL_HPP_INCLUDED
@@ -0,0 +1,384 @@
+#include "gameimage.hpp"
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+char colorCodes[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+ostream & operator << (ostream &out, const GamePixel &p) {
+    out << "Red: " << (int)p.red << ", Green: " << (int)p.green << ", Blue: " << (int)p.blue << ", Back: " << (int)p.backgroundIndex << ", Fore: " << (int)p.foregroundIndex << ", Mean:" << (((int)p.red+p.green+p.blue)/3) << endl;
+    return out;
+}
+
+bool pixelCmp(const GamePixel &a, const GamePixel &b) {
+    int meanA = ((int)a.red+a.green+a.blue)/3;
+    int meanB = ((int)b.red+b.green+b.blue)/3;
+    return (meanA < meanB) ? true : false;
+}
+
+
+// Color palette by John A. Watlington at alumni.media.mit.edu/~wad/color/palette.html
+Color colorValues[16] = {
+                                //Black
+                                {0, 0, 0},
+                                //Dark Gray
+                                {87, 87, 87},
+                                //Red
+                                {173, 35, 35},
+                                //Blue
+                                {42, 75, 215},
+                                //Green
+                                {29, 105, 20},
+                                //Brown
+                                {129, 74, 25},
+                                //Purple
+                                {129, 38, 192},
+                                //Light Gray
+                                {160, 160, 160},
+                                //Light Green
+                                {129, 197, 122},
+                                //Light Blue
+                                {157, 175, 255},
+                                //Cyan
+                                {41, 208, 208},
+                                //Orange
+                                {255, 146, 51},
+                                //Yellow
+                                {255, 238, 51},
+                                //Tan
+                                {233, 222, 187},
+                                //Pink
+                                {255, 205, 243},
+                                //White
+                                {255, 255, 255}
+};
+
+BGRAPixel expandedPalette[256];
+GamePixel gamePalette[256];
+
+void initializeExpandedColors() {
+
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 16; j++) {
+            uint8_t red, green, blue;
+            red = (int)(0.4 * colorValues[i].red + 0.6 * colorValues[j].red);
+            green = (int)(0.4 * colorValues[i].green + 0.6 * colorValues[j].green);
+            blue = (int)(0.4 * colorValues[i].blue + 0.6 * colorValues[j].blue);
+            expandedPalette[16 * i + j] = {blue, green, red};
+            gamePalette[16 * i + j] = {red, green, blue, (uint8_t) j, (uint8_t) i};
+        }
+    }
+    return;
+}
+
+void initializePalettes() {
+    initializeExpandedColors();
+    sort(gamePalette, gamePalette+255, pixelCmp);
+    sort(expandedPalette, expandedPalette+255, BGRAcmp);
+}
+
+
+
+void writeGameImageHeader(int width, int height, int frameRate, GameImageFormat format, fstream &dstVideo) {
+    uint8_t rateByte = frameRate;
+    if (format == GameImageFormat::Version2) rateByte |= 0x80;
+    dstVideo << (uint8_t) (width>>8) << (uint8_t) (width&0x00ff) << (uint8_t) (height>>8) << (uint8_t) (height&0x00ff) << rateByte;
+}
+
+size_t maxEncodedFrameSize(int width, int height, GameImageFormat format) {
+    if (format == GameImageFormat::Version2) return 1 + 2 * (size_t) width * height; // A Full frame is never beaten by a bigger delta
+    return 4 + 6 * (size_t) width * height; // A version 1 keyframe
+}
+
+// Writes one pixel record at out and returns the position after it
+static inline uint8_t * encodePixel(uint8_t * out, int i, int width, uint8_t paletteIndex) {
+    uint16_t x = i % width + 1;
+    uint16_t y = i / width + 1;
+    memcpy(out, &x, 2);
+    memcpy(out+2, &y, 2);
+    out[4] = colorCodes[gamePalette[paletteIndex].backgroundIndex];
+    out[5] = colorCodes[gamePalette[paletteIndex].foregroundIndex];
+    return out + 6;
+}
+
+static inline uint8_t * encodeColors(uint8_t * out, uint8_t paletteIndex) {
+    out[0] = colorCodes[gamePalette[paletteIndex].backgroundIndex];
+    out[1] = colorCodes[gamePalette[paletteIndex].foregroundIndex];
+    return out + 2;
+}
+
+// Finds the next span of changed cells in row [rowStart, rowEnd) at or after i. Returns false if there is none.
+// Gaps of up to SPAN_MAX_GAP unchanged cells are drawn as part of the span, since a new span header costs as much.
+static const int SPAN_MAX_GAP = 3;
+static inline bool nextSpan(const uint8_t * data, const uint8_t * oldFrame, int &i, int rowEnd, int &spanEnd) {
+    while (i < rowEnd && data[i] == oldFrame[i]) i++;
+    if (i == rowEnd) return false;
+    spanEnd = i + 1;
+    int gap = 0;
+    for (int j = spanEnd; j < rowEnd; j++) {
+        if (data[j] != oldFrame[j]) {
+            spanEnd = j + 1;
+            gap = 0;
+        } else if (++gap > SPAN_MAX_GAP) {
+            break;
+        }
+    }
+    return true;
+}
+
+static size_t encodeFullFrame(int pixelCount, uint8_t * data, uint8_t * out) {
+    uint8_t * start = out;
+    *out++ = (uint8_t) FrameType::Full;
+    for (int i = 0; i < pixelCount; i++) {
+        out = encodeColors(out, data[i]);
+    }
+    return out - start;
+}
+
+// sendFirstPixel always sends pixel 0, so a version 1 frame is never empty. Sets changedPixels, if given, to the number
+// of pixels that really differ.
+static size_t encodePixelFrame(int width, int height, uint8_t * data, uint8_t * oldFrame, uint8_t * out, bool sendFirstPixel, int * changedPixels) {
+    uint8_t * start = out;
+    uint32_t changedCount = 0;
+    out += 4; // Pixel count goes in front once it is known
+    for (int i = 0; i < width * height; i++) {
+        if (data[i] == oldFrame[i] && !(sendFirstPixel && i == 0)) continue;
+        out = encodePixel(out, i, width, data[i]);
+        changedCount++;
+    }
+    memcpy(start, &changedCount, 4);
+    if (changedPixels != nullptr) *changedPixels = changedCount - (sendFirstPixel && data[0] == oldFrame[0] ? 1 : 0);
+    return out - start;
+}
+
+static size_t encodeSpanFrame(int width, int height, uint8_t * data, uint8_t * oldFrame, uint8_t * out) {
+    uint8_t * start = out;
+    *out++ = (uint8_t) FrameType::Spans;
+    uint8_t * countPosition = out;
+    uint32_t spanCount = 0;
+    out += 4;
+    for (int y = 0; y < height; y++) {
+        int i = y * width;
+        int rowEnd = i + width;
+        int spanEnd;
+        while (nextSpan(data, oldFrame, i, rowEnd, spanEnd)) {
+            uint16_t header[3] = { (uint16_t) (i - y * width + 1), (uint16_t) (y + 1), (uint16_t) (spanEnd - i) };
+            memcpy(out, header, 6);
+            out += 6;
+            for (; i < spanEnd; i++) {
+                out = encodeColors(out, data[i]);
+            }
+            spanCount++;
+        }
+    }
+    memcpy(countPosition, &spanCount, 4);
+    return out - start;
+}
+
+size_t encodeGameImage(int width, int height, uint8_t * data, uint8_t * oldFrame, vector<uint8_t> &buffer, GameImageFormat format, int * changedPixels) {
+    if (buffer.size() < maxEncodedFrameSize(width, height, format)) buffer.resize(maxEncodedFrameSize(width, height, format));
+    return encodeGameImage(width, height, data, oldFrame, buffer.data(), format, changedPixels);
+}
+
+size_t encodeGameImage(int width, int height, uint8_t * data, uint8_t * oldFrame, uint8_t * out, GameImageFormat format, int * changedPixels) {
+
+    int pixelCount = width * height;
+    uint8_t * start = out;
+    if (oldFrame == nullptr && changedPixels != nullptr) *changedPixels = pixelCount;
+
+    if (format == GameImageFormat::Version1) {
+        // Output every pixel if oldFrame does not exist. First frame of video.
+        if (oldFrame == nullptr) {
+            memcpy(out, &pixelCount, 4);
+            out += 4;
+            for (int i = 0; i < pixelCount; i++) {
+                out = encodePixel(out, i, width, data[i]);
+            }
+            return out - start;
+        }
+        return encodePixelFrame(width, height, data, oldFrame, out, true, changedPixels);
+    }
+
+    if (oldFrame == nullptr) return encodeFullFrame(pixelCount, data, out);
+
+    // Size every frame type in one pass, then only encode the smallest
+    size_t changedCount = 0;
+    size_t spanCount = 0;
+    size_t spanCells = 0;
+    for (int y = 0; y < height; y++) {
+        int i = y * width;
+        int rowEnd = i + width;
+        int spanEnd;
+        while (nextSpan(data, oldFrame, i, rowEnd, spanEnd)) {
+            spanCount++;
+            spanCells += spanEnd - i;
+            for (; i < spanEnd; i++) {
+                if (data[i] != oldFrame[i]) changedCount++;
+            }
+        }
+    }
+    if (changedPixels != nullptr) *changedPixels = changedCount;
+    size_t fullSize = 1 + 2 * (size_t) pixelCount;
+    size_t pixelSize = 1 + 4 + 6 * changedCount;
+    size_t spanSize = 1 + 4 + 6 * spanCount + 2 * spanCells;
+
+    if (fullSize <= pixelSize && fullSize <= spanSize) return encodeFullFrame(pixelCount, data, out);
+    if (pixelSize < spanSize) {
+        *out = (uint8_t) FrameType::Pixels;
+        return 1 + encodePixelFrame(width, height, data, oldFrame, out + 1, false, nullptr);
+    }
+    return encodeSpanFrame(width, height, data, oldFrame, out);
+}
+
+bool isKeyframeDue(int frameNumber, int keyframeInterval) {
+    return keyframeInterval > 0 && frameNumber % keyframeInterval == 0;
+}
+
+// Version 1 only has sparse pixel frames, so only the first frame of a file stands on its own
+bool isKeyframe(const uint8_t * encodedFrame, GameImageFormat format) {
+    return format == GameImageFormat::Version2 && encodedFrame[0] == (uint8_t) FrameType::Full;
+}
+
+void writeSeekTable(const vector<SeekTableEntry> &entries, fstream &dstVideo) {
+    uint64_t tableOffset = dstVideo.tellp();
+    uint32_t frameCount = entries.size();
+    vector<uint8_t> table(1 + 4 + 9 * entries.size() + 16);
+    uint8_t * out = table.data();
+    *out++ = (uint8_t) FrameType::SeekTable;
+    memcpy(out, &frameCount, 4);
+    out += 4;
+    for (auto& entry : entries) {
+        memcpy(out, &entry.offset, 8);
+        out[8] = entry.isKeyframe ? 1 : 0;
+        out += 9;
+    }
+    memcpy(out, &tableOffset, 8);
+    memcpy(out + 8, "CCVPSEEK", 8);
+    dstVideo.write( (char *) table.data(), table.size());
+}
+
+GameImageWriter::GameImageWriter(int width, int height, GameImageFormat format, int keyframeInterval, fstream &dstVideo, int firstFrameNumber)
+    : dstVideo(dstVideo), buffer(maxEncodedFrameSize(width, height, format)) {
+    this->width = width;
+    this->height = height;
+    this->format = format;
+    this->keyframeInterval = keyframeInterval;
+    this->firstFrameNumber = firstFrameNumber;
+    firstOffset = dstVideo.tellp();
+    offset = firstOffset;
+}
+
+void GameImageWriter::writeFrame(uint8_t * data, uint8_t * oldFrame, int * changedPixels) {
+    int frameNumber = firstFrameNumber + entries.size();
+    if (isKeyframeDue(frameNumber, keyframeInterval)) oldFrame = nullptr; // Encoded as a full frame
+    size_t frameSize = encodeGameImage(width, height, data, oldFrame, buffer, format, changedPixels);
+    appendFrame(buffer.data(), frameSize);
+}
+
+void GameImageWriter::appendFrame(const uint8_t * encodedFrame, size_t size) {
+    if (isFailed) return;
+    if (compressionLevel == 0) {
+        dstVideo.write( (const char *) encodedFrame, size);
+        entries.push_back({offset, isKeyframe(encodedFrame, format)});
+        offset += size;
+        return;
+    }
+
+    int frameNumber = firstFrameNumber + entries.size();
+    if (blockFrameCount > 0 && isKeyframeDue(frameNumber, keyframeInterval)) startBlock();
+    block.insert(block.end(), encodedFrame, encodedFrame + size);
+    blockFrameCount++;
+    entries.push_back({0, isKeyframe(encodedFrame, format)}); // Offset is known once the block is written
+    if (blockFrameCount == framesPerBlock) startBlock();
+}
+
+void GameImageWriter::appendFrames(istream &frames, uint64_t byteCount, const vector<SeekTableEntry> &entries) {
+    if (compressionLevel > 0) {
+        // Every frame has to go into a block, so split them up again
+        for (size_t i = 0; i < entries.size(); i++) {
+            uint64_t end = (i+1 < entries.size()) ? entries[i+1].offset : byteCount;
+            if (buffer.size() < end - entries[i].offset) buffer.resize(end - entries[i].offset);
+            frames.read( (char *) buffer.data(), end - entries[i].offset);
+            appendFrame(buffer.data(), end - entries[i].offset);
+        }
+        return;
+    }
+
+    if (byteCount > 0) dstVideo << frames.rdbuf();
+    for (auto& entry : entries) {
+        this->entries.push_back({offset + entry.offset, entry.isKeyframe});
+    }
+    offset += byteCount;
+}
+
+void GameImageWriter::setCompression(int level, int framesPerBlock, TaskPool * pool) {
+    compressionLevel = level;
+    this->framesPerBlock = max(framesPerBlock, 1);
+    compressionPool = pool;
+    maxPendingBlocks = (pool != nullptr) ? pool->getWorkerCount() : 0;
+}
+
+// Hands the collected frames to the pool, and writes the oldest block if too many are in flight
+void GameImageWriter::startBlock() {
+    shared_ptr<CompressionJob> job(new CompressionJob());
+    job->frames = move(block);
+    job->frameCount = blockFrameCount;
+    job->level = compressionLevel;
+    pendingBlocks.push_back({entries.size() - blockFrameCount, blockFrameCount, job, job->result.get_future()});
+    if (compressionPool != nullptr) compressionPool->submit([job]() { job->run(); });
+    block = vector<uint8_t>();
+    blockFrameCount = 0;
+    if (pendingBlocks.size() > maxPendingBlocks) writeBlock();
+}
+
+// Compresses the oldest block right here if no worker has started on it yet. Called from a pool task (the pipeline's
+// write task), waiting for a block still in the queue could otherwise take the last free worker.
+bool GameImageWriter::writeBlock() {
+    PendingBlock & pending = pendingBlocks.front();
+    pending.job->run();
+    vector<uint8_t> data = pending.data.get(); // Waits if a worker is still compressing it
+    if (data.empty() && !isFailed) {
+        cerr << "Could not compress a block of " << pending.frameCount << " frames." << endl;
+        isFailed = true;
+    }
+    if (!isFailed) {
+        dstVideo.write( (char *) data.data(), data.size());
+        for (int i = 0; i < pending.frameCount; i++) {
+            entries[pending.firstEntry + i].offset = offset;
+        }
+        offset += data.size();
+    }
+    pendingBlocks.pop_front();
+    return !isFailed;
+}
+
+bool GameImageWriter::flush() {
+    if (blockFrameCount > 0 && !isFailed) startBlock();
+    while (!pendingBlocks.empty()) {
+        writeBlock();
+    }
+    return !isFailed && dstVideo;
+}
+
+vector<uint8_t> compressFrameBlock(const vector<uint8_t> &frames, int frameCount, int level) {
+    uLongf compressedSize = compressBound(frames.size());
+    vector<uint8_t> block(13 + compressedSize);
+    if (compress2(block.data() + 13, &compressedSize, frames.data(), frames.size(), level) != Z_OK) return vector<uint8_t>();
+    uint32_t header[3] = { (uint32_t) frameCount, (uint32_t) frames.size(), (uint32_t) compressedSize };
+    block[0] = (uint8_t) FrameType::Block;
+    memcpy(&block[1], header, 12);
+    block.resize(13 + compressedSize);
+    return block;
+}
+
+bool decompressFrameBlock(const uint8_t * block, size_t size, vector<uint8_t> &frames) {
+    if (size < 13 || block[0] != (uint8_t) FrameType::Block) return false;
+    uint32_t header[3];
+    memcpy(header, &block[1], 12);
+    if (header[2] > size - 13) return false;
+    frames.resize(header[1]);
+    uLongf frameBytes = header[1];
+    return uncompress(frames.data(), &frameBytes, block + 13, header[2]) == Z_OK && frameBytes == header[1];
+}
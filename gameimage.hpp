@@ -0,0 +1,170 @@
+#ifndef GAMEIMAGE_HPP_INCLUDED
+#define GAMEIMAGE_HPP_INCLUDED
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <future>
+#include <memory>
+#include <cstdint>
+#include "fastpixelmap.hpp"
+#include "taskpool.hpp"
+
+// Output video format, as read by the player. The file starts with a 5 byte header: uint16 width, uint16 height
+// (big-endian) and the frame rate. Bit 7 of the frame rate byte is set for version 2 files.
+// All multi-byte values after the header are little-endian, and x and y are 1-based.
+//
+// Version 1: every frame is a uint32 pixel count followed by that many pixels: uint16 x, uint16 y, background color
+// code, text color code (one of colorCodes each). The first frame lists every pixel, later frames the pixels that
+// changed. Pixel 1,1 is always listed.
+//
+// Version 2: every frame starts with a FrameType byte.
+//   Full:   width*height color code pairs, row by row.
+//   Pixels: uint32 count, then count version 1 pixel records.
+//   Spans:  uint32 count, then count horizontal runs: uint16 x, uint16 y, uint16 length, then length color code pairs.
+//           A span never wraps onto the next row and may contain unchanged cells.
+// The first frame is always Full. Later frames use whichever type is smallest, and may be empty. A Full frame doesn't
+// depend on earlier frames, so playback can start at any of them (a keyframe).
+//
+// A version 2 file may end with a seek table: a SeekTable type byte, a uint32 frame count, then for every frame a
+// uint64 byte offset from the start of the file and a flags byte (bit 0: keyframe). The last 16 bytes of the file are
+// the uint64 offset of the SeekTable byte and the magic "CCVPSEEK", so a player can find the table from the end.
+// A player reading frames in order just stops at the SeekTable byte.
+//
+// Frames of a version 2 file may be packed into compressed blocks: a Block type byte, uint32 frame count, uint32
+// uncompressed size, uint32 compressed size, then a zlib stream holding that many ordinary frames back to back. Every
+// block inflates on its own. Seek table offsets of frames inside a block point at the block.
+
+enum class GameImageFormat { Version1 = 1, Version2 = 2 };
+enum class FrameType : uint8_t { Full = 0, Pixels = 1, Spans = 2, SeekTable = 3, Block = 4 };
+
+struct SeekTableEntry {
+    uint64_t offset;
+    bool isKeyframe;
+};
+
+extern char colorCodes[16];
+
+struct Color {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+};
+
+struct GamePixel {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+    uint8_t backgroundIndex;
+    uint8_t foregroundIndex;
+    friend std::ostream & operator << (std::ostream &out, const GamePixel &p);
+};
+
+bool pixelCmp(const GamePixel &a, const GamePixel &b);
+
+extern Color colorValues[16];
+extern BGRAPixel expandedPalette[256]; // Palette given to FastPixelMap
+extern GamePixel gamePalette[256]; // Same order as expandedPalette, with the color codes each entry is drawn with
+
+void initializeExpandedColors();
+// Fills and sorts expandedPalette and gamePalette
+void initializePalettes();
+
+// Writes the file header. Version 2 needs frameRate < 128.
+void writeGameImageHeader(int width, int height, int frameRate, GameImageFormat format, std::fstream &dstVideo);
+// Largest possible encoded frame, in bytes
+size_t maxEncodedFrameSize(int width, int height, GameImageFormat format = GameImageFormat::Version1);
+// Serializes a frame into buffer, which is grown to maxEncodedFrameSize if needed. Returns the number of bytes used.
+// oldFrame is the previous pal8 frame, or nullptr for the first frame. changedPixels, if given, is set to the number of
+// pixels that differ from oldFrame (all of them without one), counted on the way.
+size_t encodeGameImage(int width, int height, uint8_t * data, uint8_t * oldFrame, std::vector<uint8_t> &buffer, GameImageFormat format, int * changedPixels = nullptr);
+// Same, into out, which must hold maxEncodedFrameSize bytes for the format
+size_t encodeGameImage(int width, int height, uint8_t * data, uint8_t * oldFrame, uint8_t * out, GameImageFormat format, int * changedPixels = nullptr);
+// True if frame frameNumber (0 is the first frame of the file) must be a Full frame. keyframeInterval 0 never forces one.
+bool isKeyframeDue(int frameNumber, int keyframeInterval);
+// True if an encoded frame can be decoded without the frames before it
+bool isKeyframe(const uint8_t * encodedFrame, GameImageFormat format);
+// Packs frameCount encoded frames into a Block with zlib at the given level (1-9). Returns an empty vector if zlib fails.
+std::vector<uint8_t> compressFrameBlock(const std::vector<uint8_t> &frames, int frameCount, int level);
+// Inflates a Block back into its frames. Returns false if it is damaged.
+bool decompressFrameBlock(const uint8_t * block, size_t size, std::vector<uint8_t> &frames);
+// Appends the seek table for a version 2 file. entries has one entry per frame, in order.
+void writeSeekTable(const std::vector<SeekTableEntry> &entries, std::fstream &dstVideo);
+
+// Encodes frames in order and appends them to a file. Forces a keyframe every keyframeInterval frames (0 never does)
+// and remembers where every frame starts, for the seek table. With compression on, frames are collected into blocks
+// that are compressed in the background, and flush() must be called once the last frame is in. If a block can't be
+// compressed, nothing more is written and flush() returns false.
+class GameImageWriter {
+
+public:
+    // dstVideo's current position is taken as where the first frame goes. firstFrameNumber is the number of that frame
+    // in the whole video, which decides where the keyframes fall.
+    GameImageWriter(int width, int height, GameImageFormat format, int keyframeInterval, std::fstream &dstVideo, int firstFrameNumber = 0);
+
+    // oldFrame is the pal8 frame before this one, or nullptr for the first frame. changedPixels as for encodeGameImage,
+    // all of them for a forced keyframe.
+    void writeFrame(uint8_t * data, uint8_t * oldFrame, int * changedPixels = nullptr);
+    // Appends a frame that was already encoded, e.g. on a converter thread. The caller forces keyframes itself.
+    void appendFrame(const uint8_t * encodedFrame, size_t size);
+    // Appends byteCount bytes of frames encoded by another writer, e.g. on another thread. entries are the other
+    // writer's, with offsets from the start of frames.
+    void appendFrames(std::istream &frames, uint64_t byteCount, const std::vector<SeekTableEntry> &entries);
+    // Level 1-9, 0 turns it off. A block also ends before every forced keyframe, so seeking never inflates more
+    // than one block. Blocks are compressed as tasks on pool, at most one per worker at a time, or on the calling thread
+    // if pool is nullptr. The pool must outlive the writer.
+    void setCompression(int level, int framesPerBlock, TaskPool * pool);
+    // Writes the blocks still being compressed. Returns false if a block failed or the file can't be written.
+    bool flush();
+    bool writeSeekTable() {
+        if (!flush()) return false;
+        ::writeSeekTable(entries, dstVideo);
+        return (bool) dstVideo;
+    }
+
+    int getFramesWritten() const { return entries.size(); }
+    uint64_t getBytesWritten() const { return offset - firstOffset; }
+    const std::vector<SeekTableEntry> & getEntries() const { return entries; }
+
+private:
+    int width;
+    int height;
+    GameImageFormat format;
+    int keyframeInterval;
+    std::fstream &dstVideo;
+    int firstFrameNumber;
+    uint64_t firstOffset;
+    uint64_t offset;
+    std::vector<SeekTableEntry> entries;
+    std::vector<uint8_t> buffer;
+
+    // Compressed by whichever comes first: a pool worker, or writeBlock needing the result
+    struct CompressionJob {
+        std::atomic<bool> isClaimed{false};
+        std::vector<uint8_t> frames;
+        int frameCount;
+        int level;
+        std::promise<std::vector<uint8_t>> result;
+        void run() { if (!isClaimed.exchange(true)) result.set_value(compressFrameBlock(frames, frameCount, level)); }
+    };
+    struct PendingBlock {
+        size_t firstEntry;
+        int frameCount;
+        std::shared_ptr<CompressionJob> job;
+        std::future<std::vector<uint8_t>> data;
+    };
+    void startBlock();
+    bool writeBlock();
+
+    int compressionLevel = 0;
+    int framesPerBlock;
+    TaskPool * compressionPool = nullptr;
+    size_t maxPendingBlocks = 0;
+    bool isFailed = false;
+    std::vector<uint8_t> block; // Frames not yet handed to a compressor
+    int blockFrameCount = 0;
+    std::deque<PendingBlock> pendingBlocks;
+
+};
+
+#endif // GAMEIMAGE_HPP_INCLUDED
@@ -1,237 +1,649 @@
 #include <iostream>
 #include <vector>
 #include <thread>
-#include <mutex>
 #include <algorithm>
-#include <queue>
 #include <functional>
 #include <atomic>
+#include <chrono>
+#include <iomanip>
 #include "decodevideo.hpp"
 #include "fastpixelmap.hpp"
+#include "colorlut.hpp"
+#include "pipelinequeue.hpp"
+#include "framepool.hpp"
+#include "gameimage.hpp"
+#include "taskpool.hpp"
+#include "benchmark.hpp"
+#include "pipelinestats.hpp"
 
 using namespace std;
 
-char colorCodes[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
-
-struct Color {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-};
-
-struct GamePixel {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-    uint8_t backgroundIndex;
-    uint8_t foregroundIndex;
-    friend std::ostream & operator << (std::ostream &out, const GamePixel &p);
+// Settings for every VideoDecoder of a run
+struct DecoderOptions {
+    int threads = 0; // 0 = let FFMPEG pick from core count
+    double startTime = 0; // --start and --end, in seconds
+    double endTime = -1;
+    string indexCachePath;
+    const FrameIndex * frameIndex = nullptr; // Shared with every segment decoder, so the file is only indexed once
 };
 
-struct Pixel {
-    int x;
-    int y;
-    int backgroundIndex;
-    int textIndex;
+// Per-run settings shared by every converter thread
+struct ConverterOptions {
+    const ColorLUT * colorLUT = nullptr;
+    FastPixelMap::SearchMethod searchMethod = FastPixelMap::SearchMethod::MPS;
+    FastPixelMap::DitherMethod ditherMethod = FastPixelMap::DitherMethod::SierraLite;
+    int frameThreads = 1;
+    bool temporalReuse = false;
+    bool staticTiles = false;
+
+    void apply(FastPixelMap & pixelMapper) const {
+        pixelMapper.setColorLUT(colorLUT);
+        pixelMapper.setSearchMethod(searchMethod);
+        pixelMapper.setDitherMethod(ditherMethod);
+        pixelMapper.setFrameThreads(frameThreads);
+        pixelMapper.setTemporalReuse(temporalReuse);
+        pixelMapper.setStaticTiles(staticTiles);
+    }
 };
 
-struct ConvertJob {
-    int frameNumber;
-    uint8_t* frame;
+// How the converted frames are written
+struct EncoderOptions {
+    GameImageFormat format = GameImageFormat::Version1; // Version2 only with --format 2, older players only read version 1
+    int keyframeInterval = 0; // Full frame every n frames, 0 = only where it is the smallest encoding
+    bool hasSeekTable = false;
+    int compressionLevel = 0; // zlib level, 0 = frames are stored raw
+    int framesPerBlock = 64;
 };
 
 struct WriteJob {
     int frameNumber;
-    uint8_t* frame;
+    FrameBuffer encodedFrame; // Ready to append to the file
+    size_t size;
 };
 
-bool operator> (const WriteJob &lhs, const WriteJob &rhs) {
-    return lhs.frameNumber > rhs.frameNumber;
-}
-
-ostream & operator << (ostream &out, const GamePixel &p) {
-    out << "Red: " << (int)p.red << ", Green: " << (int)p.green << ", Blue: " << (int)p.blue << ", Back: " << (int)p.backgroundIndex << ", Fore: " << (int)p.foregroundIndex << ", Mean:" << (((int)p.red+p.green+p.blue)/3) << endl;
-    return out;
-}
+typedef ReorderQueue<WriteJob> WriteJobQueue;
+typedef FramePairs<FrameBuffer> Pal8FramePairs;
 
-bool pixelCmp(const GamePixel &a, const GamePixel &b) {
-    int meanA = ((int)a.red+a.green+a.blue)/3;
-    int meanB = ((int)b.red+b.green+b.blue)/3;
-    return (meanA < meanB) ? true : false;
-}
+bool isVerbose = false;
 
+// What one pool worker needs to scale and map frames, created the first time it converts one
+struct ConverterState {
+    ConverterState(int width, int height, const ConverterOptions & options)
+        : pixelMapper((uint8_t*)expandedPalette, 256, width, height, true), scaler(width, height, AV_PIX_FMT_BGRA),
+          bgraLinesize((width + (ALIGNMENT-(width%ALIGNMENT))%ALIGNMENT) * 4), bgraPool(bgraLinesize * height) {
+        options.apply(pixelMapper);
+        bgraImage = bgraPool.acquire(); // Reused for every frame
+    }
 
-// Color palette by John A. Watlington at alumni.media.mit.edu/~wad/color/palette.html
-Color colorValues[16] = {
-                                //Black
-                                {0, 0, 0},
-                                //Dark Gray
-                                {87, 87, 87},
-                                //Red
-                                {173, 35, 35},
-                                //Blue
-                                {42, 75, 215},
-                                //Green
-                                {29, 105, 20},
-                                //Brown
-                                {129, 74, 25},
-                                //Purple
-                                {129, 38, 192},
-                                //Light Gray
-                                {160, 160, 160},
-                                //Light Green
-                                {129, 197, 122},
-                                //Light Blue
-                                {157, 175, 255},
-                                //Cyan
-                                {41, 208, 208},
-                                //Orange
-                                {255, 146, 51},
-                                //Yellow
-                                {255, 238, 51},
-                                //Tan
-                                {233, 222, 187},
-                                //Pink
-                                {255, 205, 243},
-                                //White
-                                {255, 255, 255}
+    FastPixelMap pixelMapper;
+    FrameScaler scaler; // Every worker scales its own frames, so scaling keeps up with any number of workers
+    int bgraLinesize; // Padded like FastPixelMap expects
+    FramePool bgraPool;
+    FrameBuffer bgraImage;
 };
 
-BGRAPixel expandedPalette[256];
-GamePixel gamePalette[256];
+/*
+Single pipeline as tasks on a TaskPool: decode -> convert (scale and map) -> encode -> write. Any worker runs whatever is
+runnable, so no core sits idle while the bottleneck moves between stages.
+
+Decoding and writing have to happen in order, so there is at most one decode task and one write task at a time. The
+decode task decodes until maxFramesInFlight frames are between decoder and file, which bounds memory like the old
+queue sizes did, and the write task starts it again as frames leave. A convert task maps one frame and, through
+FramePairs, starts an encode task for every frame whose previous frame is now mapped too. Encoded frames wait in a
+ReorderQueue, and the write task appends them in order.
+*/
+struct Pipeline {
+    Pipeline(int width, int height, const ConverterOptions & converterOptions, const EncoderOptions & encoderOptions,
+             VideoDecoder & decoder, GameImageWriter & writer, TaskPool & pool, PipelineStats & stats, int maxFramesInFlight)
+        : converterOptions(converterOptions), encoderOptions(encoderOptions), decoder(decoder), writer(writer), pool(pool), stats(stats),
+          decodedFrames(maxFramesInFlight), converters(pool.getWorkerCount()), pal8Pool(width * height),
+          encodedPool(maxEncodedFrameSize(width, height, encoderOptions.format)), pal8Frames(1), encodedFrames(maxFramesInFlight, 1) {
+        this->width = width;
+        this->height = height;
+        this->maxFramesInFlight = maxFramesInFlight;
+    }
 
-void initializeExpandedColors() {
+    int width;
+    int height;
+    const ConverterOptions & converterOptions;
+    const EncoderOptions & encoderOptions;
+    VideoDecoder & decoder;
+    GameImageWriter & writer;
+    TaskPool & pool;
+    PipelineStats & stats;
+    int maxFramesInFlight;
+
+    vector<DecodedFrame> decodedFrames; // Waiting for a convert task, at frameNumber % maxFramesInFlight
+    vector<unique_ptr<ConverterState>> converters; // Per worker
+    FramePool pal8Pool;
+    FramePool encodedPool;
+    Pal8FramePairs pal8Frames;
+    WriteJobQueue encodedFrames;
+
+    atomic<int> framesInFlight{0};
+    atomic<int> framesDecoded{0};
+    atomic<int> framesWritten{0};
+    atomic<bool> isDecoding{false};
+    atomic<bool> isWriting{false};
+    atomic<bool> isDecoderDone{false};
+    atomic<bool> isFinished{false};
+    ThreadParker finished;
+};
 
-    for (int i = 0; i < 16; i++) {
-        for (int j = 0; j < 16; j++) {
-            uint8_t red, green, blue;
-            red = (int)(0.4 * colorValues[i].red + 0.6 * colorValues[j].red);
-            green = (int)(0.4 * colorValues[i].green + 0.6 * colorValues[j].green);
-            blue = (int)(0.4 * colorValues[i].blue + 0.6 * colorValues[j].blue);
-            expandedPalette[16 * i + j] = {blue, green, red};
-            gamePalette[16 * i + j] = {red, green, blue, (uint8_t) j, (uint8_t) i};
-        }
+void runDecodeTask(Pipeline & pipeline);
+void runWriteTask(Pipeline & pipeline);
+
+void checkFinished(Pipeline & pipeline) {
+    if (pipeline.isDecoderDone && pipeline.framesWritten == pipeline.framesDecoded && !pipeline.isFinished.exchange(true)) {
+        pipeline.finished.notifyAll();
     }
-    return;
 }
 
-queue<ConvertJob> convertJobQueue;
-mutex convertJobMutex;
-priority_queue<WriteJob, vector<WriteJob>, greater<WriteJob> > writeJobQueue; // Min Priority queue.
-mutex writeJobMutex;
-int finalFrameNumber = -1;
-atomic<bool> isFinished;
-
-bool isVerbose = false;
+// Starts the decode task unless it is running, done, or too far ahead of the writer
+void scheduleDecode(Pipeline & pipeline) {
+    if (pipeline.isDecoderDone || pipeline.framesInFlight >= pipeline.maxFramesInFlight) return;
+    if (pipeline.isDecoding.exchange(true)) return;
+    pipeline.pool.submit([&pipeline]() { runDecodeTask(pipeline); });
+}
 
-void runDecoderThread(int width, int height, int outputFrameRate, VideoDecoder & decoder) {
+// Starts the write task unless it is running or the next frame isn't encoded yet
+void scheduleWrite(Pipeline & pipeline) {
+    if (!pipeline.encodedFrames.isNextReady() || pipeline.isWriting.exchange(true)) return;
+    pipeline.pool.submit([&pipeline]() { runWriteTask(pipeline); });
+}
 
+void runEncodeTask(Pipeline & pipeline, int frameNumber) {
+    auto start = chrono::steady_clock::now();
+    uint8_t * frame = pipeline.pal8Frames.get(frameNumber).get();
+    bool isFirstOrKeyframe = frameNumber == 1 || isKeyframeDue(frameNumber - 1, pipeline.encoderOptions.keyframeInterval);
+    uint8_t * oldFrame = isFirstOrKeyframe ? nullptr : pipeline.pal8Frames.get(frameNumber - 1).get();
+    FrameBuffer encodedFrame = pipeline.encodedPool.acquire();
+    int changedPixels;
+    size_t size = encodeGameImage(pipeline.width, pipeline.height, frame, oldFrame, encodedFrame.get(), pipeline.encoderOptions.format, &changedPixels);
+    pipeline.stats.stageDone(PipelineStats::Encode, start);
+    pipeline.stats.recordEncodedFrame(size, changedPixels, pipeline.width * pipeline.height);
+    pipeline.pal8Frames.done(frameNumber);
+
+    pipeline.encodedFrames.push(frameNumber, {frameNumber, move(encodedFrame), size}); // Never waits, the window covers every frame in flight
+    pipeline.stats.recordFramesWaiting(pipeline.encodedFrames.size());
+    if (isVerbose) cout << "Worker " << TaskPool::currentWorker() << " encoded frame " << frameNumber << endl;
+    scheduleWrite(pipeline);
+}
 
-    decoder.seekFrame(0);
-    uint8_t* image = nullptr; // Don't need to allocate, decoder has an internal buffer that is used.
-    int frameSize = decoder.frameSizeInBytes;
-    int frameNumber = 1;
-    for (int i = 0; true; i++) {
+// Scales and maps a frame, RELEASES THE ORIGINAL FRAME, then starts encoding every frame it completed a pair for
+void runConvertTask(Pipeline & pipeline, int frameNumber) {
+    int width = pipeline.width;
+    int height = pipeline.height;
+    unique_ptr<ConverterState> & converter = pipeline.converters[TaskPool::currentWorker()];
+    if (!converter) converter.reset(new ConverterState(width, height, pipeline.converterOptions));
+
+    DecodedFrame frame = move(pipeline.decodedFrames[frameNumber % pipeline.maxFramesInFlight]);
+    FrameBuffer pal8Image = pipeline.pal8Pool.acquire();
+    auto start = chrono::steady_clock::now();
+    bool isScaled = converter->scaler.scale(frame.get(), converter->bgraImage.get(), converter->bgraLinesize);
+    frame = DecodedFrame(); // Hand the buffer back to FFMPEG
+    pipeline.stats.stageDone(PipelineStats::Filter, start);
+    start = chrono::steady_clock::now();
+    if (isScaled) converter->pixelMapper.convertImage(converter->bgraImage.get(), converter->bgraLinesize, pal8Image.get());
+    else fill(pal8Image.get(), pal8Image.get() + width*height, 0); // Keep the frame count and timing intact
+    pipeline.stats.stageDone(PipelineStats::Convert, start);
+
+    //if (frameNumber == 500) writePal8PPM("paletteTest.ppm", width, height, pal8Image.get(), (uint8_t*) expandedPalette);
+    if (frameNumber == 500) writePPM("test.ppm", width, height, converter->bgraImage.get(), true);
+
+    int readyFrames[2];
+    int readyCount = pipeline.pal8Frames.add(frameNumber, move(pal8Image), readyFrames);
+    for (int i = 0; i < readyCount; i++) {
+        int readyFrame = readyFrames[i];
+        pipeline.pool.submit([&pipeline, readyFrame]() { runEncodeTask(pipeline, readyFrame); });
+    }
+}
 
-        // Retrieve decoded BGRA image
-        image = decoder.readFrame(); // decoder only returns nullptr when at EOF
-        if (image == nullptr) {
-                finalFrameNumber = frameNumber;
-                return; //EOF
+// The decoder must already be at the first frame to convert
+void runDecodeTask(Pipeline & pipeline) {
+    while (pipeline.framesInFlight < pipeline.maxFramesInFlight) {
+        // Retrieve the decoded frame unscaled. No copy, the convert task holds the decoder's reference until it has scaled it.
+        auto start = chrono::steady_clock::now();
+        DecodedFrame image = pipeline.decoder.readNativeFrame(); // decoder only returns an empty frame when at EOF
+        if (!image) {
+            pipeline.isDecoderDone = true; // isDecoding stays set, so this task never runs again
+            checkFinished(pipeline);
+            return;
         }
-
-        // Add frame to queue as convertJob. Have to allocate new memory for frame, don't have to touch uint8_t* image.
-        uint8_t *queueFrame = new uint8_t[frameSize];
-        copy(image, image+frameSize-1, queueFrame);
-        convertJobMutex.lock();
-        convertJobQueue.push( {frameNumber, queueFrame} );
-        if (isVerbose) cout << "DECODER PUSHED: " << convertJobQueue.size() << endl;
-        convertJobMutex.unlock();
-
-        frameNumber++;
-
+        int frameNumber = pipeline.framesDecoded + 1;
+        pipeline.decodedFrames[frameNumber % pipeline.maxFramesInFlight] = move(image);
+        pipeline.framesInFlight++;
+        pipeline.framesDecoded = frameNumber;
+        pipeline.stats.stageDone(PipelineStats::Decode, start);
+        pipeline.stats.recordFramesInFlight(pipeline.framesInFlight);
+        pipeline.pool.submit([&pipeline, frameNumber]() { runConvertTask(pipeline, frameNumber); });
+        if (isVerbose) cout << "DECODED: " << frameNumber << ", frames in flight: " << pipeline.framesInFlight << endl;
     }
+    pipeline.isDecoding = false;
+    scheduleDecode(pipeline); // A frame may have been written since the loop's last check
 }
 
-void runConverterThread(int width, int height, int threadNo) {
+// Appends every frame that is next in line, then lets the decoder refill the pipeline
+void runWriteTask(Pipeline & pipeline) {
+    WriteJob job;
+    while (pipeline.encodedFrames.tryPopNext(job)) {
+        auto start = chrono::steady_clock::now();
+        pipeline.writer.appendFrame(job.encodedFrame.get(), job.size);
+        pipeline.stats.stageDone(PipelineStats::Write, start);
+        job.encodedFrame.release();
+        pipeline.framesWritten++;
+        pipeline.framesInFlight--;
+        scheduleDecode(pipeline);
+    }
+    pipeline.isWriting = false;
+    scheduleWrite(pipeline); // The next frame may have arrived after the last tryPopNext
+    checkFinished(pipeline);
+}
 
+// Part of the movie converted on its own by one segment worker, starting at a keyframe
+struct Segment {
+    int64_t keyframePts;
+    int firstOutputFrame;
+    int endOutputFrame; // -1 runs to the end of the movie
+    string tempFileName; // Every frame but the first, encoded against the frame before it
+    uint64_t tempFileBytes = 0;
+    vector<SeekTableEntry> seekEntries; // Frames in the temp file, offsets from its start
+    vector<uint8_t> firstFrame; // pal8. Encoded while stitching, against the previous segment's last frame.
+    vector<uint8_t> lastFrame;
+    int framesConverted = 0;
+};
 
+// Takes segments until there are none left. Each one is decoded, scaled, mapped and encoded on this thread alone, so
+// workers never wait on each other. A segment that can't be started sets isFailed, which stops every worker, since the
+// output would be missing its frames. busyNanoseconds is the time spent on segments, start to finish.
+void runSegmentWorker(int width, int height, int frameRate, const char * srcFileName, const DecoderOptions & decoderOptions, const ConverterOptions & options,
+                      const EncoderOptions & encoderOptions, vector<Segment> & segments, atomic<int> & nextSegment, atomic<bool> & isFailed,
+                      PipelineStats & stats, long long & busyNanoseconds) {
+
+    VideoDecoder decoder(width, height, frameRate, srcFileName, decoderOptions.threads);
+    decoder.setIndexCachePath(decoderOptions.indexCachePath);
+    if (decoderOptions.frameIndex != nullptr) decoder.setFrameIndex(*decoderOptions.frameIndex);
+    decoder.setClip(decoderOptions.startTime, decoderOptions.endTime);
     FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, width, height, true);
+    options.apply(pixelMapper);
+
+    FrameScaler scaler(width, height, AV_PIX_FMT_BGRA);
+    int bgraLinesize = (width + (ALIGNMENT-(width%ALIGNMENT))%ALIGNMENT) * 4;
+    FramePool bgraPool(bgraLinesize * height);
+    FrameBuffer bgraImage = bgraPool.acquire();
+    vector<uint8_t> pal8Image(width * height), oldPal8Image(width * height);
+
+    for (int i = nextSegment++; i < (int) segments.size() && !isFailed; i = nextSegment++) {
+        auto segmentStart = chrono::steady_clock::now();
+        Segment & segment = segments[i];
+        fstream segmentFile(segment.tempFileName, ios::out | ios::trunc | ios::binary);
+        if (!segmentFile.is_open()) {
+            cerr << segment.tempFileName << ": File could not be opened." << endl;
+            isFailed = true;
+            return;
+        }
+        if (!decoder.seekSegment(segment.keyframePts, segment.firstOutputFrame, segment.endOutputFrame)) {
+            cerr << "Could not seek to segment " << i << "." << endl;
+            isFailed = true;
+            return;
+        }
+        GameImageWriter writer(width, height, encoderOptions.format, encoderOptions.keyframeInterval, segmentFile, segment.firstOutputFrame + 1);
+
+        auto start = chrono::steady_clock::now();
+        while (DecodedFrame frame = decoder.readNativeFrame()) {
+            if (isFailed) return;
+            stats.stageDone(PipelineStats::Decode, start);
+            start = chrono::steady_clock::now();
+            bool isScaled = scaler.scale(frame.get(), bgraImage.get(), bgraLinesize);
+            stats.stageDone(PipelineStats::Filter, start);
+            start = chrono::steady_clock::now();
+            if (isScaled) pixelMapper.convertImage(bgraImage.get(), bgraLinesize, pal8Image.data());
+            else fill(pal8Image.begin(), pal8Image.end(), 0);
+            stats.stageDone(PipelineStats::Convert, start);
+
+            if (segment.framesConverted == 0) {
+                segment.firstFrame = pal8Image;
+            } else {
+                start = chrono::steady_clock::now();
+                uint64_t bytesBefore = writer.getBytesWritten();
+                int changedPixels;
+                writer.writeFrame(pal8Image.data(), oldPal8Image.data(), &changedPixels);
+                stats.stageDone(PipelineStats::Encode, start);
+                stats.recordEncodedFrame(writer.getBytesWritten() - bytesBefore, changedPixels, width * height);
+            }
+            segment.framesConverted++;
+            swap(pal8Image, oldPal8Image);
+            start = chrono::steady_clock::now();
+        }
+        segment.lastFrame = oldPal8Image;
+        segment.tempFileBytes = writer.getBytesWritten();
+        segment.seekEntries = writer.getEntries();
+        busyNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - segmentStart).count();
+        if (isVerbose) cout << "Segment " << i << ": " << segment.framesConverted << " frames from output frame " << segment.firstOutputFrame << endl;
+    }
+}
 
-    // Grab frame from convertJobQueue, convert it, and DEALLOCATE ORIGINAL FRAME
-    // Then add converted frame to writeJobQueue along with frameNumber
-    for (int i = 0; true; i++) {
+// Splits the movie at keyframes and converts the pieces in parallel, each with its own decoder. The first frame of every
+// segment is encoded against the last frame of the segment before it, so the result is byte for byte what a single
+// pipeline would write. Keyframes fall on the same frames too. threadCount is the --threads setting, which sizes the
+// pool that compresses blocks while stitching. Returns the number of frames written, or -1 if a segment failed.
+// Constant frame rate input only: a segment's first output frame number comes from its keyframe's time, while a single
+// decoder counts the frames it keeps, and the two only agree when frames are evenly spaced. See hasConstantFrameRate.
+int convertSegmented(int width, int height, int decoderFrameRate, const char * srcFileName, VideoDecoder & decoder,
+                     int workerCount, int threadCount, DecoderOptions decoderOptions, const ConverterOptions & options,
+                     const EncoderOptions & encoderOptions, const string & dstFileName, fstream & dstVideo, PipelineStats & stats) {
+
+    // Keyframes inside the clip, plus its start. The first segment starts exactly at the start of the clip.
+    decoderOptions.frameIndex = &decoder.getFrameIndex();
+    vector<int64_t> keyframes = {0};
+    for (int64_t keyframePts : decoderOptions.frameIndex->keyframePts) {
+        double time = decoder.presentationTime(keyframePts);
+        if (time > 0 && (decoderOptions.endTime < 0 || time < decoderOptions.endTime - decoderOptions.startTime)) keyframes.push_back(keyframePts);
+    }
 
-        if (isFinished == true) return; // Decoder has returned and writer has finished writing. Thus, converter must be done and busy waiting. return.
+    // A few segments per worker, so workers that get short segments pick up more instead of idling at the end
+    int segmentCount = min((int) keyframes.size(), 4 * workerCount);
+    vector<Segment> segments;
+    for (int i = 0; i < segmentCount; i++) {
+        int64_t keyframePts = keyframes[(size_t) i * keyframes.size() / segmentCount];
+        int firstOutputFrame = (i == 0) ? 0 : decoder.outputFrameAt(keyframePts);
+        if (!segments.empty() && firstOutputFrame <= segments.back().firstOutputFrame) continue; // No output frame between the keyframes
+        if (!segments.empty()) segments.back().endOutputFrame = firstOutputFrame;
+        Segment segment;
+        segment.keyframePts = keyframePts;
+        segment.firstOutputFrame = firstOutputFrame;
+        segment.endOutputFrame = -1;
+        segment.tempFileName = dstFileName + ".segment" + to_string(segments.size());
+        segments.push_back(move(segment));
+    }
+    cout << "Converting " << segments.size() << " segments on " << workerCount << " workers" << endl;
+
+    atomic<int> nextSegment(0);
+    atomic<bool> isFailed(false);
+    vector<thread> workers;
+    vector<long long> busyNanoseconds(workerCount, 0);
+    auto workersStart = chrono::steady_clock::now();
+    for (int i = 0; i < workerCount; i++) {
+        workers.emplace_back(runSegmentWorker, width, height, decoderFrameRate, srcFileName, cref(decoderOptions), cref(options),
+                             cref(encoderOptions), ref(segments), ref(nextSegment), ref(isFailed), ref(stats), ref(busyNanoseconds[i]));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    // Workers never spin. Whatever they didn't spend on segments went to setting up and waiting for the slowest one.
+    long long workersNanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - workersStart).count();
+    vector<TaskPool::WorkerTimes> workerTimes;
+    for (long long busy : busyNanoseconds) {
+        workerTimes.push_back({busy, 0, max(workersNanoseconds - busy, 0LL)});
+    }
+    stats.setWorkerTimes(workerTimes);
+    if (isFailed) {
+        for (auto& segment : segments) {
+            remove(segment.tempFileName.c_str());
+        }
+        return -1;
+    }
 
-        ConvertJob job;
-        convertJobMutex.lock();
-        if (convertJobQueue.size() > 0) {
-            job = convertJobQueue.front();
-            convertJobQueue.pop();
-        } else {
-            convertJobMutex.unlock();
-            continue;
+    // Stitch the segments together in order. Blocks are compressed on threadCount workers, as many as the run may use.
+    unique_ptr<TaskPool> compressionPool;
+    if (encoderOptions.compressionLevel > 0) compressionPool.reset(new TaskPool(threadCount, false));
+    GameImageWriter writer(width, height, encoderOptions.format, encoderOptions.keyframeInterval, dstVideo);
+    writer.setCompression(encoderOptions.compressionLevel, encoderOptions.framesPerBlock, compressionPool.get());
+    vector<uint8_t> * previousFrame = nullptr;
+    for (auto& segment : segments) {
+        if (segment.framesConverted > 0) {
+            auto start = chrono::steady_clock::now();
+            uint64_t bytesBefore = writer.getBytesWritten();
+            int changedPixels;
+            writer.writeFrame(segment.firstFrame.data(), previousFrame ? previousFrame->data() : nullptr, &changedPixels);
+            stats.stageDone(PipelineStats::Encode, start);
+            stats.recordEncodedFrame(writer.getBytesWritten() - bytesBefore, changedPixels, width * height);
+            start = chrono::steady_clock::now();
+            fstream segmentFile(segment.tempFileName, ios::in | ios::binary);
+            if (!segmentFile.is_open()) {
+                cerr << segment.tempFileName << ": File could not be opened." << endl;
+                for (auto& other : segments) {
+                    remove(other.tempFileName.c_str());
+                }
+                return -1;
+            }
+            writer.appendFrames(segmentFile, segment.tempFileBytes, segment.seekEntries);
+            stats.stageDone(PipelineStats::Write, start, segment.framesConverted);
+            previousFrame = &segment.lastFrame;
+        }
+        remove(segment.tempFileName.c_str());
+    }
+    if (!writer.flush() || (encoderOptions.hasSeekTable && !writer.writeSeekTable())) return -1;
+    return writer.getFramesWritten();
+}
+
+// Converts the benchmark scene with every dither method and prints conversion time and encoded delta size side by side.
+void benchmarkDithering(int width, int height, ConverterOptions options, GameImageFormat format) {
+    const int frameCount = 48;
+    vector<uint8_t> image(4 * width * height);
+    vector<uint8_t> pal8Image(width * height), oldPal8Image(width * height);
+    vector<uint8_t> encodeBuffer(maxEncodedFrameSize(width, height));
+
+    cout << "Dithering " << frameCount << " " << width << "x" << height << " frames" << endl;
+    const pair<const char *, FastPixelMap::DitherMethod> methods[] = {
+        {"sierra", FastPixelMap::DitherMethod::SierraLite},
+        {"bayer", FastPixelMap::DitherMethod::Bayer},
+        {"bluenoise", FastPixelMap::DitherMethod::BlueNoise}
+    };
+    for (auto& method : methods) {
+        FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, width, height, false);
+        options.ditherMethod = method.second;
+        options.apply(pixelMapper);
+
+        double convertSeconds = 0;
+        size_t deltaBytes = 0;
+        for (int frame = 0; frame < frameCount; frame++) {
+            drawBenchmarkScene(image, width, height, frame, frameCount);
+            auto start = chrono::steady_clock::now();
+            pixelMapper.convertImage(image.data(), pal8Image.data());
+            convertSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (frame > 0) deltaBytes += encodeGameImage(width, height, pal8Image.data(), oldPal8Image.data(), encodeBuffer, format);
+            swap(pal8Image, oldPal8Image);
         }
-        convertJobMutex.unlock();
+        cout << method.first << ": " << 1000 * convertSeconds / frameCount << " ms/frame, "
+             << deltaBytes / (frameCount - 1) << " delta bytes/frame" << endl;
+    }
+}
 
+// Encodes the benchmark scene as version 2 frames, then prints the compression ratio and speed of every zlib level
+void benchmarkCompression(int width, int height, const ConverterOptions & options, int framesPerBlock) {
+    const int frameCount = 192;
+    vector<uint8_t> image(4 * width * height);
+    vector<uint8_t> pal8Image(width * height), oldPal8Image(width * height);
+    vector<uint8_t> encodeBuffer;
+    FastPixelMap pixelMapper((uint8_t*)expandedPalette, 256, width, height, false);
+    options.apply(pixelMapper);
+
+    // Blocks of encoded frames, like GameImageWriter collects them
+    vector<vector<uint8_t>> blocks;
+    vector<int> blockFrameCounts;
+    size_t rawBytes = 0;
+    for (int frame = 0; frame < frameCount; frame++) {
+        drawBenchmarkScene(image, width, height, frame, frameCount);
+        pixelMapper.convertImage(image.data(), pal8Image.data());
+        size_t size = encodeGameImage(width, height, pal8Image.data(), frame > 0 ? oldPal8Image.data() : nullptr, encodeBuffer, GameImageFormat::Version2);
+        if (frame % framesPerBlock == 0) {
+            blocks.emplace_back();
+            blockFrameCounts.push_back(0);
+        }
+        blocks.back().insert(blocks.back().end(), encodeBuffer.begin(), encodeBuffer.begin() + size);
+        blockFrameCounts.back()++;
+        rawBytes += size;
+        swap(pal8Image, oldPal8Image);
+    }
 
-        uint8_t* pal8Image = pixelMapper.convertImage(job.frame); // pixelMapper allocates memory for us.
+    cout << "Compressing " << frameCount << " " << width << "x" << height << " frames (" << rawBytes << " bytes) in blocks of "
+         << framesPerBlock << " frames, on one thread" << endl;
+    cout << "level    ratio  compress MiB/s  decompress MiB/s" << endl;
+    vector<uint8_t> frames;
+    for (int level = 1; level <= 9; level++) {
+        size_t compressedBytes = 0;
+        int rounds = 0;
+        vector<vector<uint8_t>> compressedBlocks;
+        double compressSeconds = timePasses([&]() {
+            compressedBlocks.clear();
+            for (size_t i = 0; i < blocks.size(); i++) {
+                compressedBlocks.push_back(compressFrameBlock(blocks[i], blockFrameCounts[i], level));
+            }
+            rounds++;
+        });
+        for (auto& block : compressedBlocks) {
+            compressedBytes += block.size();
+        }
 
-        //if (job.frameNumber == 500) writePal8PPM("paletteTest.ppm", width, height, pal8Image, (uint8_t*) expandedPalette);
-        if (job.frameNumber == 500) writePPM("test.ppm", width, height, job.frame, true);
+        int decompressRounds = 0;
+        double decompressSeconds = timePasses([&]() {
+            for (auto& block : compressedBlocks) {
+                decompressFrameBlock(block.data(), block.size(), frames);
+            }
+            decompressRounds++;
+        });
 
-        writeJobMutex.lock();
-        writeJobQueue.push( {job.frameNumber, pal8Image} );
-        if (isVerbose) cout << "Thread " << threadNo << ", pushed to writeJobQueue, new size of " << writeJobQueue.size() << endl;
-        writeJobMutex.unlock();
+        cout << fixed << setprecision(2) << setw(5) << level << setw(9) << (double) rawBytes / compressedBytes << setprecision(1)
+             << setw(16) << rawBytes * rounds / compressSeconds / (1 << 20) << setw(18) << rawBytes * decompressRounds / decompressSeconds / (1 << 20) << endl;
+    }
+}
 
-        delete [] job.frame;
+// Every converting worker's mapper brings frameThreads-1 helper threads along, so the pool gets fewer workers to keep
+// the total within threadCount. Returns the pool's worker count.
+int fitFrameThreads(ConverterOptions & options, int threadCount) {
+    if (options.frameThreads > threadCount) {
+        cout << "Frame threads limited to " << threadCount << ", the number of threads available." << endl;
+        options.frameThreads = threadCount;
     }
+    return max(threadCount / options.frameThreads, 1);
+}
 
+// Converts the decoder's frames on a single pipeline of workerCount workers and writes them after the header already in
+// dstVideo. Returns the number of frames written, or -1 if they couldn't all be written.
+int convertSingle(int width, int height, const ConverterOptions & converterOptions, const EncoderOptions & encoderOptions,
+                  VideoDecoder & decoder, fstream & dstVideo, int workerCount, bool pinWorkers, int queueSize, PipelineStats & stats) {
+    TaskPool pool(workerCount, pinWorkers); // Also compresses the blocks
+    GameImageWriter writer(width, height, encoderOptions.format, encoderOptions.keyframeInterval, dstVideo);
+    writer.setCompression(encoderOptions.compressionLevel, encoderOptions.framesPerBlock, &pool);
+    Pipeline pipeline(width, height, converterOptions, encoderOptions, decoder, writer, pool, stats, queueSize);
+    scheduleDecode(pipeline);
+    pipeline.finished.wait([&pipeline]() { return pipeline.isFinished.load(); });
+    bool isWritten = writer.flush() && (!encoderOptions.hasSeekTable || writer.writeSeekTable()); // The last blocks still use the pool
+    pool.shutdown(); // Before the pipeline goes away, a worker may still be on its way out of the last task
+    stats.setWorkerTimes(pool);
+
+    if (!isWritten) return -1;
+    if (isVerbose) cout << "Frame buffers allocated: " << pipeline.pal8Pool.getAllocationCount() << " pal8, " << pipeline.encodedPool.getAllocationCount() << " encoded" << endl;
+    return writer.getFramesWritten();
 }
 
-void writeGameImage(int width, int height, int frameRate, uint8_t * data, uint8_t * oldFrame, fstream &dstVideo) {
-
-    int pixelCount = width * height;
-
-    // Output every pixel if oldFrame does not exist. First frame of video.
-    if (oldFrame == nullptr) {
-        dstVideo.write( (char *) &pixelCount, 4);
-        for (int i = 0; i < pixelCount; i++) {
-            //cout << "x: " << i % width + 1 << ", y: " << i / width + 1 << ", back: " << (int)gamePalette[data[i]].backgroundIndex << ", fore: " << (int)gamePalette[data[i]].foregroundIndex << endl;
-            uint16_t x = i % width + 1;
-            uint16_t y = i / width + 1;
-            dstVideo.write( (char *) &x, 2);
-            dstVideo.write( (char *) &y, 2);
-            dstVideo << colorCodes[gamePalette[data[i]].backgroundIndex] << colorCodes[gamePalette[data[i]].foregroundIndex];
-            //dstVideo << (uint8_t) i % width + 1 << (uint8_t) i / width + 1 << colorCodes[gamePalette[data[i]].backgroundIndex] << colorCodes[gamePalette[data[i]].foregroundIndex];
+// Times every stage on its own on the synthetic scene and the movie's first frames, then the whole pipeline with the given
+// options on the movie, and writes the results to reportFileName as JSON. The movie is optional. Returns 1 if a check failed.
+int runBenchmarkSuite(string reportFileName, string movie, int width, int height, int frameRate, const DecoderOptions & decoderOptions,
+                      const ConverterOptions & converterOptions, const EncoderOptions & encoderOptions, int workerCount, bool pinWorkers, int queueSize) {
+    const int frameCount = 48;
+    BenchmarkReport report(width, height, movie);
+    vector<BenchmarkInput> inputs;
+    inputs.push_back(syntheticBenchmarkInput(width, height, frameCount));
+    if (!movie.empty()) {
+        inputs.push_back(movieBenchmarkInput(movie, width, height, frameRate, frameCount));
+        if (inputs.back().frames.empty()) {
+            cerr << movie << ": No frames could be read." << endl;
+            return -1;
         }
-        return;
     }
+    for (auto& input : inputs) {
+        benchmarkMapper(report, input, converterOptions.colorLUT);
+        benchmarkFullSearch(report, input);
+        checkMPSSearch(report, input);
+        benchmarkEncoder(report, input, encoderOptions.format);
+    }
+
+    if (!movie.empty()) {
+        benchmarkDecoder(report, movie, width, height, frameRate, frameCount);
 
-    vector<Pixel> convertedFrame;
-    for(int i = 0; i < width * height; i++) {
-        uint8_t paletteIndex = data[i];
-        if (oldFrame[i] == paletteIndex && i != 0) {
-            continue;
+        string scratchFileName = reportFileName + ".video";
+        fstream scratchVideo(scratchFileName, ios::out | ios::in | ios::trunc | ios::binary);
+        if (!scratchVideo.is_open()) {
+            cerr << scratchFileName << ": File could not be opened." << endl;
+            return -1;
         }
-        GamePixel color = gamePalette[paletteIndex];
-        Pixel pixel = { i % width + 1, i / width + 1, color.backgroundIndex, color.foregroundIndex };
-        convertedFrame.push_back(pixel);
+        VideoDecoder decoder(width, height, frameRate, movie, decoderOptions.threads);
+        decoder.setClip(decoderOptions.startTime, decoderOptions.endTime);
+        if (decoderOptions.startTime > 0 && !decoder.seekTime(0)) {
+            cerr << "Could not seek to " << decoderOptions.startTime << " seconds." << endl;
+            return -1;
+        }
+        if (workerCount < 1) workerCount = max((int) thread::hardware_concurrency(), 1);
+        ConverterOptions pipelineOptions = converterOptions;
+        workerCount = fitFrameThreads(pipelineOptions, workerCount);
+        if (queueSize < 1) queueSize = 2 * workerCount;
+        writeGameImageHeader(width, height, min(frameRate, 127), encoderOptions.format, scratchVideo);
+
+        PipelineStats stats(queueSize);
+        auto start = chrono::steady_clock::now();
+        int framesWritten = convertSingle(width, height, pipelineOptions, encoderOptions, decoder, scratchVideo, workerCount, pinWorkers, queueSize, stats);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        long long outputBytes = scratchVideo.tellp();
+        scratchVideo.close();
+        remove(scratchFileName.c_str());
+        if (framesWritten > 0) report.addResult({"pipeline", "movie", to_string(workerCount) + " workers", framesWritten, seconds, (long long) width * height, outputBytes});
     }
-    int frameSize = convertedFrame.size();
-    dstVideo.write( (char *) &frameSize, 4);
-    for (int i = 0; i < convertedFrame.size(); i++) {
-        uint16_t xCoord = convertedFrame[i].x;
-        uint16_t yCoord = convertedFrame[i].y;
-        dstVideo.write( (char *) &xCoord, 2);
-        dstVideo.write( (char *) &yCoord, 2);
 
-        dstVideo << colorCodes[convertedFrame[i].backgroundIndex] << colorCodes[convertedFrame[i].textIndex];
+    ofstream reportFile(reportFileName);
+    if (!reportFile.is_open()) {
+        cerr << reportFileName << ": File could not be opened." << endl;
+        return -1;
+    }
+    report.write(reportFile);
+    cout << "Benchmark results written to " << reportFileName << endl;
+    return report.allChecksPassed() ? 0 : 1;
+}
 
+void printRunSummary(const PipelineStats & stats, int framesWritten, long long outputBytes) {
+    cout << "Frames written: " <<  framesWritten << endl;
+    if (framesWritten > 0) {
+        long long convertNanoseconds = stats.getStageNanoseconds(PipelineStats::Filter) + stats.getStageNanoseconds(PipelineStats::Convert);
+        cout << "Conversion time (scaling and mapping): " << convertNanoseconds / 1e6 / framesWritten << " ms/frame, output size: "
+             << outputBytes << " bytes (" << outputBytes / framesWritten << " bytes/frame)" << endl;
     }
-    return;
+}
+
+void printUsage() {
+    cout << "Usage: videoConverter <movie> [width height [frameRate]] [options]" << endl;
+    cout << "Options:" << endl;
+    cout << "  --lut <dir>             Map colors through a precomputed 16 MiB lookup table, cached in <dir>" << endl;
+    cout << "  --search <mps|vector>   Palette search used while dithering. Default mps" << endl;
+    cout << "  --simd <kernel>         Limit vector search to auto, scalar, sse4.1, avx2 or avx512" << endl;
+    cout << "  --dither <method>       sierra (error diffusion), bayer or bluenoise. Ordered dithers keep still areas stable. Default sierra" << endl;
+    cout << "  --frame-threads <n>     Dither each frame on n threads as a wavefront. The pipeline gets 1/n of the workers. Default 1" << endl;
+    cout << "  --temporal-reuse        Skip the palette search for pixels whose color barely changed since the converter's last frame." << endl;
+    cout << "                          Needs --search vector, so the output doesn't depend on which worker got which frame" << endl;
+    cout << "  --static-tiles          Only map the 16x16 tiles that changed since the converter's last frame. Sierra error stops at tile edges" << endl;
+    cout << "  --decoder-threads <n>   Threads FFMPEG decodes the movie with. Default 0, picked from core count" << endl;
+    cout << "  --start <seconds>       Convert from this time on. Seeks to the nearest earlier keyframe and decodes forward" << endl;
+    cout << "  --end <seconds>         Stop converting at this time" << endl;
+    cout << "  --index-cache           Save the movie's frame index next to it as <movie>.index, to seek faster next time" << endl;
+    cout << "  --segments <n>          Split the movie at keyframes and convert it on n independent pipelines. Constant frame rate" << endl;
+    cout << "                          movies only, others use the single pipeline" << endl;
+    cout << "  --threads <n>           Worker threads that decode, convert, encode and write. Default one per hardware thread" << endl;
+    cout << "  --affinity              Pin worker n to CPU n (Linux)" << endl;
+    cout << "  --queue-size <n>        Frames that may be between decoder and file at once. Default 2 per worker" << endl;
+    cout << "  --format <1|2>          Output format version. 2 adds full and span frames, but older players only read 1. Default 1" << endl;
+    cout << "  --keyframe-interval <n> Write a full frame at least every n frames, so playback can start there. Implies --seek-table" << endl;
+    cout << "  --seek-table            End the file with a table of frame offsets and keyframes (format 2 only)" << endl;
+    cout << "  --compress <level>      Store frames in zlib blocks, level 1 (fast) to 9 (small). Format 2 only" << endl;
+    cout << "  --block-frames <n>      Frames per compressed block. Default 64" << endl;
+    cout << "  --benchmark <file>      Time decoder, mapper, encoder and pipeline on a synthetic scene and the movie, if one is given," << endl;
+    cout << "                          and write the results as JSON to <file>. Checks MPS against full search. Stages run with default" << endl;
+    cout << "                          settings, the pipeline with the given options" << endl;
+    cout << "  --bench-compression     Measure block compression of a synthetic scene at every level at the given resolution, then exit" << endl;
+    cout << "  --bench-dither          Compare dither methods on a synthetic scene at the given resolution, then exit" << endl;
+    cout << "  --bench-encoder         Measure frame encoding speed at the given resolution, then exit" << endl;
+    cout << "  --progress              Print frames converted, fps and time left every second" << endl;
+    cout << "  --stats <file>          Write per stage times, queue depths, worker busy/spin/idle time and frame sizes as JSON to <file>" << endl;
+    cout << "  --verbose               Print queue activity" << endl;
 }
 
 int main(int argc, char *argv[])
@@ -239,41 +651,262 @@ int main(int argc, char *argv[])
     int width = 164;
     int height = 81;
     int frameRate = 12;
-    char * srcFileName;
-    if (argc < 2) {
+    const char * srcFileName;
+
+    // Options start with "--" and may appear anywhere. Everything else is positional: movie [width height [frameRate]]
+    vector<string> positionalArgs;
+    ConverterOptions converterOptions;
+    bool useColorLUT = false;
+    string lutCacheDirectory;
+    int queueSize = 0; // 0 = pick from worker count
+    int workerCount = 0; // 0 = one per hardware thread
+    bool pinWorkers = false;
+    DecoderOptions decoderOptions;
+    int segmentWorkers = 0; // 0 = single pipeline
+    bool useIndexCache = false;
+    bool benchmarkEncoder = false;
+    bool benchmarkDither = false;
+    bool benchmarkCompressionLevels = false;
+    string benchmarkReportFileName;
+    bool showProgress = false;
+    string statsFileName;
+    EncoderOptions encoderOptions;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--lut") {
+            if (i+1 >= argc) {
+                cerr << "--lut requires a cache directory." << endl;
+                return -1;
+            }
+            useColorLUT = true;
+            lutCacheDirectory = argv[++i];
+        } else if (arg == "--search") {
+            string method = (i+1 < argc) ? argv[++i] : "";
+            if (method == "mps") converterOptions.searchMethod = FastPixelMap::SearchMethod::MPS;
+            else if (method == "vector") converterOptions.searchMethod = FastPixelMap::SearchMethod::Vector;
+            else {
+                cerr << "--search must be mps or vector." << endl;
+                return -1;
+            }
+        } else if (arg == "--simd") {
+            if (i+1 >= argc || !PaletteSearch::setPreferredKernel(argv[++i])) {
+                cerr << "--simd must be auto, scalar, sse4.1, avx2 or avx512." << endl;
+                return -1;
+            }
+        } else if (arg == "--dither") {
+            string method = (i+1 < argc) ? argv[++i] : "";
+            if (method == "sierra") converterOptions.ditherMethod = FastPixelMap::DitherMethod::SierraLite;
+            else if (method == "bayer") converterOptions.ditherMethod = FastPixelMap::DitherMethod::Bayer;
+            else if (method == "bluenoise") converterOptions.ditherMethod = FastPixelMap::DitherMethod::BlueNoise;
+            else {
+                cerr << "--dither must be sierra, bayer or bluenoise." << endl;
+                return -1;
+            }
+        } else if (arg == "--frame-threads") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1) {
+                cerr << "--frame-threads requires a positive thread count." << endl;
+                return -1;
+            }
+            converterOptions.frameThreads = stoi(argv[++i]);
+        } else if (arg == "--temporal-reuse") {
+            converterOptions.temporalReuse = true;
+        } else if (arg == "--static-tiles") {
+            converterOptions.staticTiles = true;
+        } else if (arg == "--decoder-threads") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 0) {
+                cerr << "--decoder-threads requires a thread count, or 0 for automatic." << endl;
+                return -1;
+            }
+            decoderOptions.threads = stoi(argv[++i]);
+        } else if (arg == "--start" || arg == "--end") {
+            if (i+1 >= argc || stod(argv[i+1]) < 0) {
+                cerr << arg << " requires a time in seconds." << endl;
+                return -1;
+            }
+            if (arg == "--start") decoderOptions.startTime = stod(argv[++i]);
+            else decoderOptions.endTime = stod(argv[++i]);
+        } else if (arg == "--index-cache") {
+            useIndexCache = true;
+        } else if (arg == "--segments") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1) {
+                cerr << "--segments requires a positive worker count." << endl;
+                return -1;
+            }
+            segmentWorkers = stoi(argv[++i]);
+        } else if (arg == "--threads") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1) {
+                cerr << "--threads requires a positive thread count." << endl;
+                return -1;
+            }
+            workerCount = stoi(argv[++i]);
+        } else if (arg == "--affinity") {
+            pinWorkers = true;
+        } else if (arg == "--queue-size") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1) {
+                cerr << "--queue-size requires a positive frame count." << endl;
+                return -1;
+            }
+            queueSize = stoi(argv[++i]);
+        } else if (arg == "--format") {
+            string version = (i+1 < argc) ? argv[++i] : "";
+            if (version == "1") encoderOptions.format = GameImageFormat::Version1;
+            else if (version == "2") encoderOptions.format = GameImageFormat::Version2;
+            else {
+                cerr << "--format must be 1 or 2." << endl;
+                return -1;
+            }
+        } else if (arg == "--keyframe-interval") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1) {
+                cerr << "--keyframe-interval requires a positive frame count." << endl;
+                return -1;
+            }
+            encoderOptions.keyframeInterval = stoi(argv[++i]);
+            encoderOptions.hasSeekTable = true;
+        } else if (arg == "--seek-table") {
+            encoderOptions.hasSeekTable = true;
+        } else if (arg == "--compress") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1 || stoi(argv[i+1]) > 9) {
+                cerr << "--compress requires a level from 1 to 9." << endl;
+                return -1;
+            }
+            encoderOptions.compressionLevel = stoi(argv[++i]);
+        } else if (arg == "--block-frames") {
+            if (i+1 >= argc || stoi(argv[i+1]) < 1) {
+                cerr << "--block-frames requires a positive frame count." << endl;
+                return -1;
+            }
+            encoderOptions.framesPerBlock = stoi(argv[++i]);
+        } else if (arg == "--benchmark") {
+            if (i+1 >= argc) {
+                cerr << "--benchmark requires a report file." << endl;
+                return -1;
+            }
+            benchmarkReportFileName = argv[++i];
+        } else if (arg == "--bench-compression") {
+            benchmarkCompressionLevels = true;
+        } else if (arg == "--bench-dither") {
+            benchmarkDither = true;
+        } else if (arg == "--bench-encoder") {
+            benchmarkEncoder = true;
+        } else if (arg == "--progress") {
+            showProgress = true;
+        } else if (arg == "--stats") {
+            if (i+1 >= argc) {
+                cerr << "--stats requires a report file." << endl;
+                return -1;
+            }
+            statsFileName = argv[++i];
+        } else if (arg == "--verbose") {
+            isVerbose = true;
+        } else if (arg.size() > 2 && arg.substr(0, 2) == "--") {
+            cerr << "Unknown option: " << arg << endl;
+            printUsage();
+            return -1;
+        } else {
+            positionalArgs.push_back(arg);
+        }
+    }
+    if (converterOptions.temporalReuse && converterOptions.searchMethod != FastPixelMap::SearchMethod::Vector) {
+        cerr << "--temporal-reuse needs --search vector. MPS can pick a different color than the one reuse proves closest." << endl;
+        return -1;
+    }
+    if ((encoderOptions.hasSeekTable || encoderOptions.compressionLevel > 0) && encoderOptions.format == GameImageFormat::Version1) {
+        cerr << "Keyframes, the seek table and compression need --format 2." << endl;
+        return -1;
+    }
+
+    if (!benchmarkReportFileName.empty()) {
+        // Same positional arguments as a conversion, but the movie is optional: [movie] [width height [frameRate]]
+        string movie;
+        size_t sizeIndex = 0;
+        if (positionalArgs.size() == 1 || positionalArgs.size() == 3 || positionalArgs.size() == 4) {
+            movie = positionalArgs[0];
+            sizeIndex = 1;
+        } else if (positionalArgs.size() > 4) {
+            cerr << "Too many arguments. Exiting." << endl;
+            return -1;
+        }
+        if (positionalArgs.size() >= sizeIndex + 2) {
+            width = stoi(positionalArgs[sizeIndex]);
+            height = stoi(positionalArgs[sizeIndex+1]);
+        }
+        if (positionalArgs.size() == 4) frameRate = stoi(positionalArgs[3]);
+        initializePalettes();
+        ColorLUT * colorLUT = useColorLUT ? new ColorLUT((uint8_t*)expandedPalette, 256, lutCacheDirectory) : nullptr;
+        if (colorLUT != nullptr && colorLUT->isValid()) converterOptions.colorLUT = colorLUT;
+        int result = runBenchmarkSuite(benchmarkReportFileName, movie, width, height, frameRate, decoderOptions, converterOptions,
+                                       encoderOptions, workerCount, pinWorkers, queueSize);
+        delete colorLUT;
+        return result;
+    }
+
+    if (benchmarkEncoder || benchmarkDither || benchmarkCompressionLevels) {
+        // No movie is needed, so positional arguments are just width height
+        if (positionalArgs.size() >= 2) {
+            width = stoi(positionalArgs[0]);
+            height = stoi(positionalArgs[1]);
+        }
+        initializePalettes();
+        if (benchmarkEncoder) benchmarkGameImageEncoder(width, height, encoderOptions.format);
+        if (benchmarkDither || benchmarkCompressionLevels) {
+            ColorLUT * colorLUT = useColorLUT ? new ColorLUT((uint8_t*)expandedPalette, 256, lutCacheDirectory) : nullptr;
+            if (colorLUT != nullptr && colorLUT->isValid()) converterOptions.colorLUT = colorLUT;
+            if (benchmarkDither) benchmarkDithering(width, height, converterOptions, encoderOptions.format);
+            if (benchmarkCompressionLevels) benchmarkCompression(width, height, converterOptions, encoderOptions.framesPerBlock);
+            delete colorLUT;
+        }
+        return 0;
+    }
+
+    if (positionalArgs.size() < 1) {
         cout << "Please provide a movie file." << endl;
+        printUsage();
         return -1;
-    } else if (argc == 2) {
-        srcFileName = argv[1];
+    } else if (positionalArgs.size() == 1) {
+        srcFileName = positionalArgs[0].c_str();
         cout << "Using provided movie file and default resolution of 164x81." << endl;
-    } else if (argc == 4) {
-        srcFileName = argv[1];
-        width = stoi(argv[2]);
-        height = stoi(argv[3]);
+    } else if (positionalArgs.size() == 3) {
+        srcFileName = positionalArgs[0].c_str();
+        width = stoi(positionalArgs[1]);
+        height = stoi(positionalArgs[2]);
         cout << "Using provided movie file and resolution." << endl;
-    } else  if (argc == 5) {
-        srcFileName = argv[1];
-        width = stoi(argv[2]);
-        height = stoi(argv[3]);
-        frameRate = stoi(argv[4]);
+    } else  if (positionalArgs.size() == 4) {
+        srcFileName = positionalArgs[0].c_str();
+        width = stoi(positionalArgs[1]);
+        height = stoi(positionalArgs[2]);
+        frameRate = stoi(positionalArgs[3]);
         cout << "Using provided movie file and resolution." << endl;
     } else {
         cerr << "Too many arguments. Exiting." << endl;
         return -1;
     }
 
+    if (encoderOptions.format == GameImageFormat::Version2 && frameRate > 127) { // Bit 7 of the header byte marks the version
+        cout << "Format 2 stores at most 127 fps, using a frame rate of 127." << endl;
+        frameRate = 127;
+    }
+
     BGRAPixel palette[16];
     for (int i = 0; i < 16; i++) {
         palette[i].blue = colorValues[i].blue;
         palette[i].green = colorValues[i].green;
         palette[i].red = colorValues[i].red;
     }
-    initializeExpandedColors();
-    sort(gamePalette, gamePalette+255, pixelCmp);
-    sort(expandedPalette, expandedPalette+255, BGRAcmp);
+    initializePalettes();
     //writePPM("palette", 4, 4, (uint8_t*) palette, false);
     //writePPM("expandedPalette", 16, 16, (uint8_t*) expandedPalette, false);
 
+    // Shared by every converter thread. Must be created after expandedPalette is sorted, since the key depends on its order.
+    ColorLUT * colorLUT = nullptr;
+    if (useColorLUT) {
+        colorLUT = new ColorLUT((uint8_t*)expandedPalette, 256, lutCacheDirectory);
+        if (!colorLUT->isValid()) {
+            delete colorLUT;
+            colorLUT = nullptr;
+        }
+    }
+    converterOptions.colorLUT = colorLUT;
+
 
     string dstFileName = "outputVideo.ppm";
     fstream dstVideo(dstFileName, ios::out | ios::in | ios::trunc | ios::binary);
@@ -282,85 +915,82 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    VideoDecoder decoder(width, height, frameRate, srcFileName);
+    if (decoderOptions.endTime >= 0 && decoderOptions.endTime <= decoderOptions.startTime) {
+        cerr << "--end must be after --start." << endl;
+        return -1;
+    }
+    if (useIndexCache) decoderOptions.indexCachePath = string(srcFileName) + ".index";
+
+    VideoDecoder decoder(width, height, frameRate, srcFileName, decoderOptions.threads);
+    decoder.setIndexCachePath(decoderOptions.indexCachePath);
+    decoder.setClip(decoderOptions.startTime, decoderOptions.endTime);
     //decoder.printVideoInfo();
+    int decoderFrameRate = frameRate; // Segment decoders must pick frames exactly like this one
     double inputFrameRate = decoder.getFrameRate();
     if (inputFrameRate < frameRate) frameRate = (int)(inputFrameRate+0.5); // I don't use frame interpolation, so it makes more sense to keep the low frameRate of an input video.
-    dstVideo << (uint8_t) (width>>8) << (uint8_t) (width&0x00ff) << (uint8_t) (height>>8) << (uint8_t) (height&0x00ff) << (uint8_t) (frameRate);
+    writeGameImageHeader(width, height, frameRate, encoderOptions.format, dstVideo);
+    int expectedFrames = (int) (decoder.getDuration() * frameRate + 0.5); // For the progress line, <= 0 if unknown
 
-
-
-    // Create decoder thread, convert threads, go to write code
-    vector<thread> threads;
-    int hardwareThreads = thread::hardware_concurrency();
-    int converterThreadCount;
-    if (hardwareThreads < 3) converterThreadCount = 1;
-    else {
-        converterThreadCount = hardwareThreads - 2;
-    }
-    if (converterThreadCount > 6) converterThreadCount = 6;
-    // In short, minimum of 1 converter, max of 6, limit number of total threads to number of hardware threads
-    cout << "converter: " << converterThreadCount << endl;
-
-    threads.emplace_back(runDecoderThread, width, height, frameRate, ref(decoder));
-    for (int i = 0; i < converterThreadCount; i++) {
-        threads.emplace_back(runConverterThread, width, height, i+1);
+    if (segmentWorkers > 0 && !decoder.getFrameIndex().hasConstantFrameRate()) {
+        cout << "Frames aren't evenly spaced, which segments can't number like a single pipeline would. Using a single pipeline." << endl;
+        segmentWorkers = 0;
     }
-
-
-    uint8_t *oldPal8Image = nullptr;
-    uint8_t * pal8Image = nullptr;
-    int framesWritten = 0;
-    while (true) {
-
-        WriteJob job;
-
-
-        writeJobMutex.lock();
-        if (writeJobQueue.size() > 0) { // If job is available
-            job = writeJobQueue.top(); // Access job
-            if (job.frameNumber == framesWritten+1) { // If the job is for the next frame
-                writeJobQueue.pop(); // Take the job
-            } else {
-                writeJobMutex.unlock(); // Else, give up the job
-                continue; // Try again
-            }
-        } else {
-            //if (isVerbose) cout << "Waiting on convert: " << convertJobQueue.size() << endl;
-            writeJobMutex.unlock();
-            continue;
+    if (workerCount < 1) workerCount = max((int) thread::hardware_concurrency(), 1);
+    if (segmentWorkers > 0) {
+        // Parallelism comes from the segments, so each decoder gets one thread unless told otherwise
+        DecoderOptions segmentDecoderOptions = decoderOptions;
+        if (segmentDecoderOptions.threads == 0) segmentDecoderOptions.threads = 1;
+        int threadsPerSegment = max(workerCount / segmentWorkers, 1);
+        fitFrameThreads(converterOptions, threadsPerSegment);
+        PipelineStats stats(0); // No queues between segment stages
+        if (showProgress) stats.startProgress(expectedFrames);
+        int framesWritten = convertSegmented(width, height, decoderFrameRate, srcFileName, decoder, segmentWorkers, workerCount,
+                                             segmentDecoderOptions, converterOptions, encoderOptions, dstFileName, dstVideo, stats);
+        stats.stopProgress();
+        if (framesWritten < 0) {
+            cerr << "Conversion failed." << endl;
+            delete colorLUT;
+            return -1;
         }
+        long long outputBytes = dstVideo.tellp();
+        dstVideo.close();
+        printRunSummary(stats, framesWritten, outputBytes);
+        if (!statsFileName.empty()) stats.writeReport(statsFileName, framesWritten);
+        delete colorLUT;
+        return 0;
+    }
 
-        writeJobMutex.unlock();
-
-        pal8Image = job.frame;
-
-
-        writeGameImage(width, height, frameRate, pal8Image, oldPal8Image, dstVideo);
-        framesWritten++;
-
-        if (oldPal8Image != nullptr) {
-            //cout << "Deallocating" << endl;
-            delete[] oldPal8Image;
-        }
 
-        oldPal8Image = pal8Image;
-        pal8Image = nullptr;
+    if (decoderOptions.startTime > 0 && !decoder.seekTime(0)) {
+        cerr << "Could not seek to " << decoderOptions.startTime << " seconds." << endl;
+        return -1;
+    }
 
-        if (framesWritten == finalFrameNumber-1) {
-            isFinished = true;
-            //cout << "Joining..." << endl;
-            break;
-        }
+    workerCount = fitFrameThreads(converterOptions, workerCount);
+    cout << "Workers: " << workerCount;
+    if (converterOptions.frameThreads > 1) cout << ", " << converterOptions.frameThreads << " frame threads each";
+    cout << endl;
+    // Limits how many frames can be between decoder and file, so memory use doesn't grow with the length of the video
+    if (queueSize < 1) queueSize = 2 * workerCount;
+
+    PipelineStats stats(queueSize);
+    if (showProgress) stats.startProgress(expectedFrames);
+    int framesWritten = convertSingle(width, height, converterOptions, encoderOptions, decoder, dstVideo, workerCount, pinWorkers, queueSize, stats);
+    stats.stopProgress();
+    if (framesWritten < 0) {
+        cerr << "Conversion failed." << endl;
+        delete colorLUT;
+        return -1;
     }
 
+    long long outputBytes = dstVideo.tellp();
     dstVideo.close();
 
-    for (auto& thread : threads) {
-        thread.join();
-    }
+    printRunSummary(stats, framesWritten, outputBytes);
+    if (!statsFileName.empty()) stats.writeReport(statsFileName, framesWritten);
+    if (isVerbose) cout << "Frames skipped before decoding: " << decoder.getFramesNotDecoded() << " of " << decoder.getPacketsSkippable() << " not needed" << endl;
 
-    cout << "Frames written: " <<  framesWritten << endl;
+    delete colorLUT;
 
     return 0;
 }
@@ -0,0 +1,312 @@
+#include "palettesearch.hpp"
+#include <climits>
+#include <cstdlib>
+#include <immintrin.h>
+
+using namespace std;
+
+// Out-of-range value for padding entries. Its squared distance (x3) still fits in an int32.
+const int32_t PADDING_CHANNEL = 0x3fff;
+
+static string preferredKernel = "auto";
+
+
+PaletteSearch::~PaletteSearch() {
+    free(channelStorage);
+}
+
+bool PaletteSearch::setPreferredKernel(string name) {
+    if (name != "auto" && name != "scalar" && name != "sse4.1" && name != "avx2" && name != "avx512") return false;
+    preferredKernel = name;
+    return true;
+}
+
+bool PaletteSearch::initializeChannels(uint8_t *palette) {
+    channelStorage = (int32_t *) aligned_alloc(64, 3 * paddedSize * sizeof(int32_t));
+    if (channelStorage == nullptr) return false;
+    blues = channelStorage;
+    greens = channelStorage + paddedSize;
+    reds = channelStorage + 2*paddedSize;
+    for (int i = 0; i < paddedSize; i++) {
+        if (i < paletteSize) {
+            blues[i] = palette[i*4];
+            greens[i] = palette[i*4+1];
+            reds[i] = palette[i*4+2];
+        } else {
+            blues[i] = PADDING_CHANNEL;
+            greens[i] = PADDING_CHANNEL;
+            reds[i] = PADDING_CHANNEL;
+        }
+    }
+    return true;
+}
+
+// Picks the best lane after a vector search. Lower index wins ties, same as a scalar first-minimum search.
+static int reduceLanes(const int32_t *distances, const int32_t *indices, int laneCount) {
+    int bestDistance = distances[0];
+    int bestIndex = indices[0];
+    for (int i = 1; i < laneCount; i++) {
+        if (distances[i] < bestDistance || (distances[i] == bestDistance && indices[i] < bestIndex)) {
+            bestDistance = distances[i];
+            bestIndex = indices[i];
+        }
+    }
+    return bestIndex;
+}
+
+
+
+/*
+    Scalar kernels. Reference implementation and fallback for CPUs without SSE4.1.
+*/
+
+static int findClosestScalar(const PaletteSearch &search, int blue, int green, int red) {
+    int sedMin = INT_MAX;
+    int indexMin = 0;
+    for (int k = 0; k < search.paletteSize; k++) {
+        int blueDiff = blue - search.blues[k];
+        int greenDiff = green - search.greens[k];
+        int redDiff = red - search.reds[k];
+        int testSed = blueDiff*blueDiff + greenDiff*greenDiff + redDiff*redDiff;
+        if (testSed < sedMin) {
+            sedMin = testSed;
+            indexMin = k;
+        }
+    }
+    return indexMin;
+}
+
+static void findClosestRowScalar(const PaletteSearch &search, const uint8_t *bgra, int count, uint8_t *indices) {
+    for (int i = 0; i < count; i++) {
+        indices[i] = findClosestScalar(search, bgra[i*4], bgra[i*4+1], bgra[i*4+2]);
+    }
+}
+
+
+
+/*
+    SSE4.1 kernels. 4 palette entries (or 4 pixels) per instruction.
+*/
+
+__attribute__((target("sse4.1")))
+static int findClosestSSE41(const PaletteSearch &search, int blue, int green, int red) {
+    __m128i pixelBlue = _mm_set1_epi32(blue);
+    __m128i pixelGreen = _mm_set1_epi32(green);
+    __m128i pixelRed = _mm_set1_epi32(red);
+    __m128i minDistance = _mm_set1_epi32(INT_MAX);
+    __m128i minIndex = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i step = _mm_set1_epi32(4);
+
+    for (int k = 0; k < search.paddedSize; k += 4) {
+        __m128i blueDiff = _mm_sub_epi32(pixelBlue, _mm_load_si128((const __m128i *)(search.blues + k)));
+        __m128i greenDiff = _mm_sub_epi32(pixelGreen, _mm_load_si128((const __m128i *)(search.greens + k)));
+        __m128i redDiff = _mm_sub_epi32(pixelRed, _mm_load_si128((const __m128i *)(search.reds + k)));
+        __m128i distance = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(blueDiff, blueDiff), _mm_mullo_epi32(greenDiff, greenDiff)), _mm_mullo_epi32(redDiff, redDiff));
+        __m128i isCloser = _mm_cmpgt_epi32(minDistance, distance);
+        minDistance = _mm_min_epi32(minDistance, distance);
+        minIndex = _mm_blendv_epi8(minIndex, index, isCloser);
+        index = _mm_add_epi32(index, step);
+    }
+
+    alignas(16) int32_t distances[4];
+    alignas(16) int32_t indices[4];
+    _mm_store_si128((__m128i *) distances, minDistance);
+    _mm_store_si128((__m128i *) indices, minIndex);
+    return reduceLanes(distances, indices, 4);
+}
+
+__attribute__((target("sse4.1")))
+static void findClosestRowSSE41(const PaletteSearch &search, const uint8_t *bgra, int count, uint8_t *indices) {
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(bgra + i*4));
+        __m128i pixelBlue = _mm_and_si128(pixels, byteMask);
+        __m128i pixelGreen = _mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask);
+        __m128i pixelRed = _mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask);
+        __m128i minDistance = _mm_set1_epi32(INT_MAX);
+        __m128i minIndex = _mm_setzero_si128();
+
+        for (int k = 0; k < search.paletteSize; k++) {
+            __m128i blueDiff = _mm_sub_epi32(pixelBlue, _mm_set1_epi32(search.blues[k]));
+            __m128i greenDiff = _mm_sub_epi32(pixelGreen, _mm_set1_epi32(search.greens[k]));
+            __m128i redDiff = _mm_sub_epi32(pixelRed, _mm_set1_epi32(search.reds[k]));
+            __m128i distance = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(blueDiff, blueDiff), _mm_mullo_epi32(greenDiff, greenDiff)), _mm_mullo_epi32(redDiff, redDiff));
+            __m128i isCloser = _mm_cmpgt_epi32(minDistance, distance);
+            minDistance = _mm_min_epi32(minDistance, distance);
+            minIndex = _mm_blendv_epi8(minIndex, _mm_set1_epi32(k), isCloser);
+        }
+
+        alignas(16) int32_t laneIndices[4];
+        _mm_store_si128((__m128i *) laneIndices, minIndex);
+        for (int j = 0; j < 4; j++) indices[i+j] = laneIndices[j];
+    }
+    for (; i < count; i++) {
+        indices[i] = findClosestSSE41(search, bgra[i*4], bgra[i*4+1], bgra[i*4+2]);
+    }
+}
+
+
+
+/*
+    AVX2 kernels. 8 palette entries (or 8 pixels) per instruction.
+*/
+
+__attribute__((target("avx2")))
+static int findClosestAVX2(const PaletteSearch &search, int blue, int green, int red) {
+    __m256i pixelBlue = _mm256_set1_epi32(blue);
+    __m256i pixelGreen = _mm256_set1_epi32(green);
+    __m256i pixelRed = _mm256_set1_epi32(red);
+    __m256i minDistance = _mm256_set1_epi32(INT_MAX);
+    __m256i minIndex = _mm256_setzero_si256();
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step = _mm256_set1_epi32(8);
+
+    for (int k = 0; k < search.paddedSize; k += 8) {
+        __m256i blueDiff = _mm256_sub_epi32(pixelBlue, _mm256_load_si256((const __m256i *)(search.blues + k)));
+        __m256i greenDiff = _mm256_sub_epi32(pixelGreen, _mm256_load_si256((const __m256i *)(search.greens + k)));
+        __m256i redDiff = _mm256_sub_epi32(pixelRed, _mm256_load_si256((const __m256i *)(search.reds + k)));
+        __m256i distance = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(blueDiff, blueDiff), _mm256_mullo_epi32(greenDiff, greenDiff)), _mm256_mullo_epi32(redDiff, redDiff));
+        __m256i isCloser = _mm256_cmpgt_epi32(minDistance, distance);
+        minDistance = _mm256_min_epi32(minDistance, distance);
+        minIndex = _mm256_blendv_epi8(minIndex, index, isCloser);
+        index = _mm256_add_epi32(index, step);
+    }
+
+    alignas(32) int32_t distances[8];
+    alignas(32) int32_t indices[8];
+    _mm256_store_si256((__m256i *) distances, minDistance);
+    _mm256_store_si256((__m256i *) indices, minIndex);
+    return reduceLanes(distances, indices, 8);
+}
+
+__attribute__((target("avx2")))
+static void findClosestRowAVX2(const PaletteSearch &search, const uint8_t *bgra, int count, uint8_t *indices) {
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(bgra + i*4));
+        __m256i pixelBlue = _mm256_and_si256(pixels, byteMask);
+        __m256i pixelGreen = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byteMask);
+        __m256i pixelRed = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), byteMask);
+        __m256i minDistance = _mm256_set1_epi32(INT_MAX);
+        __m256i minIndex = _mm256_setzero_si256();
+
+        for (int k = 0; k < search.paletteSize; k++) {
+            __m256i blueDiff = _mm256_sub_epi32(pixelBlue, _mm256_set1_epi32(search.blues[k]));
+            __m256i greenDiff = _mm256_sub_epi32(pixelGreen, _mm256_set1_epi32(search.greens[k]));
+            __m256i redDiff = _mm256_sub_epi32(pixelRed, _mm256_set1_epi32(search.reds[k]));
+            __m256i distance = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(blueDiff, blueDiff), _mm256_mullo_epi32(greenDiff, greenDiff)), _mm256_mullo_epi32(redDiff, redDiff));
+            __m256i isCloser = _mm256_cmpgt_epi32(minDistance, distance);
+            minDistance = _mm256_min_epi32(minDistance, distance);
+            minIndex = _mm256_blendv_epi8(minIndex, _mm256_set1_epi32(k), isCloser);
+        }
+
+        alignas(32) int32_t laneIndices[8];
+        _mm256_store_si256((__m256i *) laneIndices, minIndex);
+        for (int j = 0; j < 8; j++) indices[i+j] = laneIndices[j];
+    }
+    for (; i < count; i++) {
+        indices[i] = findClosestAVX2(search, bgra[i*4], bgra[i*4+1], bgra[i*4+2]);
+    }
+}
+
+
+
+/*
+    AVX-512 kernels. 16 palette entries (or 16 pixels) per instruction.
+*/
+
+__attribute__((target("avx512f")))
+static int findClosestAVX512(const PaletteSearch &search, int blue, int green, int red) {
+    __m512i pixelBlue = _mm512_set1_epi32(blue);
+    __m512i pixelGreen = _mm512_set1_epi32(green);
+    __m512i pixelRed = _mm512_set1_epi32(red);
+    __m512i minDistance = _mm512_set1_epi32(INT_MAX);
+    __m512i minIndex = _mm512_setzero_si512();
+    __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i step = _mm512_set1_epi32(16);
+
+    for (int k = 0; k < search.paddedSize; k += 16) {
+        __m512i blueDiff = _mm512_sub_epi32(pixelBlue, _mm512_load_si512(search.blues + k));
+        __m512i greenDiff = _mm512_sub_epi32(pixelGreen, _mm512_load_si512(search.greens + k));
+        __m512i redDiff = _mm512_sub_epi32(pixelRed, _mm512_load_si512(search.reds + k));
+        __m512i distance = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(blueDiff, blueDiff), _mm512_mullo_epi32(greenDiff, greenDiff)), _mm512_mullo_epi32(redDiff, redDiff));
+        __mmask16 isCloser = _mm512_cmplt_epi32_mask(distance, minDistance);
+        minDistance = _mm512_min_epi32(minDistance, distance);
+        minIndex = _mm512_mask_blend_epi32(isCloser, minIndex, index);
+        index = _mm512_add_epi32(index, step);
+    }
+
+    alignas(64) int32_t distances[16];
+    alignas(64) int32_t indices[16];
+    _mm512_store_si512(distances, minDistance);
+    _mm512_store_si512(indices, minIndex);
+    return reduceLanes(distances, indices, 16);
+}
+
+__attribute__((target("avx512f")))
+static void findClosestRowAVX512(const PaletteSearch &search, const uint8_t *bgra, int count, uint8_t *indices) {
+    const __m512i byteMask = _mm512_set1_epi32(0xff);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i pixels = _mm512_loadu_si512(bgra + i*4);
+        __m512i pixelBlue = _mm512_and_si512(pixels, byteMask);
+        __m512i pixelGreen = _mm512_and_si512(_mm512_srli_epi32(pixels, 8), byteMask);
+        __m512i pixelRed = _mm512_and_si512(_mm512_srli_epi32(pixels, 16), byteMask);
+        __m512i minDistance = _mm512_set1_epi32(INT_MAX);
+        __m512i minIndex = _mm512_setzero_si512();
+
+        for (int k = 0; k < search.paletteSize; k++) {
+            __m512i blueDiff = _mm512_sub_epi32(pixelBlue, _mm512_set1_epi32(search.blues[k]));
+            __m512i greenDiff = _mm512_sub_epi32(pixelGreen, _mm512_set1_epi32(search.greens[k]));
+            __m512i redDiff = _mm512_sub_epi32(pixelRed, _mm512_set1_epi32(search.reds[k]));
+            __m512i distance = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(blueDiff, blueDiff), _mm512_mullo_epi32(greenDiff, greenDiff)), _mm512_mullo_epi32(redDiff, redDiff));
+            __mmask16 isCloser = _mm512_cmplt_epi32_mask(distance, minDistance);
+            minDistance = _mm512_min_epi32(minDistance, distance);
+            minIndex = _mm512_mask_blend_epi32(isCloser, minIndex, _mm512_set1_epi32(k));
+        }
+
+        _mm_storeu_si128((__m128i *)(indices + i), _mm512_cvtepi32_epi8(minIndex));
+    }
+    for (; i < count; i++) {
+        indices[i] = findClosestAVX512(search, bgra[i*4], bgra[i*4+1], bgra[i*4+2]);
+    }
+}
+
+
+
+void PaletteSearch::selectKernels() {
+    __builtin_cpu_init();
+    bool hasAVX512 = __builtin_cpu_supports("avx512f");
+    bool hasAVX2 = __builtin_cpu_supports("avx2");
+    bool hasSSE41 = __builtin_cpu_supports("sse4.1");
+
+    // A preferred kernel is only a ceiling. Never pick something the CPU can't run.
+    if (preferredKernel == "scalar") {
+        hasAVX512 = hasAVX2 = hasSSE41 = false;
+    } else if (preferredKernel == "sse4.1") {
+        hasAVX512 = hasAVX2 = false;
+    } else if (preferredKernel == "avx2") {
+        hasAVX512 = false;
+    }
+
+    if (hasAVX512) {
+        closestKernel = findClosestAVX512;
+        rowKernel = findClosestRowAVX512;
+        kernelName = "avx512";
+    } else if (hasAVX2) {
+        closestKernel = findClosestAVX2;
+        rowKernel = findClosestRowAVX2;
+        kernelName = "avx2";
+    } else if (hasSSE41) {
+        closestKernel = findClosestSSE41;
+        rowKernel = findClosestRowSSE41;
+        kernelName = "sse4.1";
+    } else {
+        closestKernel = findClosestScalar;
+        rowKernel = findClosestRowScalar;
+        kernelName = "scalar";
+    }
+}
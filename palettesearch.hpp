@@ -0,0 +1,61 @@
+#ifndef PALETTESEARCH_HPP_INCLUDED
+#define PALETTESEARCH_HPP_INCLUDED
+#include <iostream>
+#include <string>
+#include <cstdint>
+
+// Exhaustive nearest-color search using SIMD. Checks 4 (SSE4.1), 8 (AVX2) or 16 (AVX-512) palette entries per instruction.
+// The instruction set is chosen at runtime from what the CPU supports, so a single binary runs at full speed everywhere.
+// Ties are broken towards the lowest palette index, exactly like FastPixelMap::fullSearchConvertImage.
+// palette is BGRA, paletteSize is number of colors.
+class PaletteSearch {
+
+public:
+    PaletteSearch(uint8_t *palette, int paletteSize) {
+        this->paletteSize = paletteSize;
+        paddedSize = (paletteSize + 15) & ~15; // Multiple of the widest vector so kernels never need a tail loop
+        if (!initializeChannels(palette)) std::cerr << "Failed to initialize PaletteSearch channels!" << std::endl;
+        selectKernels();
+    }
+
+    ~PaletteSearch();
+    PaletteSearch(const PaletteSearch &) = delete;
+    PaletteSearch & operator=(const PaletteSearch &) = delete;
+
+    // Channels must already be clamped to [0, 255]
+    int findClosest(int blue, int green, int red) const {
+        return closestKernel(*this, blue, green, red);
+    }
+    // Maps count unpadded BGRA pixels at once. Used when there is no dithering, since pixels are then independent.
+    void findClosestRow(const uint8_t *bgra, int count, uint8_t *indices) const {
+        rowKernel(*this, bgra, count, indices);
+    }
+
+    const char* getKernelName() const { return kernelName; }
+
+    // Restricts runtime dispatch to a kernel: "auto", "scalar", "sse4.1", "avx2" or "avx512".
+    // Affects PaletteSearch objects constructed afterwards. Returns false for unknown names.
+    static bool setPreferredKernel(std::string name);
+
+    int paletteSize;
+    int paddedSize;
+    // Structure of arrays, 64-byte aligned. Entries past paletteSize are far out of range so they never win.
+    int32_t *blues;
+    int32_t *greens;
+    int32_t *reds;
+
+private:
+    int32_t *channelStorage;
+
+    typedef int (*ClosestKernel)(const PaletteSearch &search, int blue, int green, int red);
+    typedef void (*RowKernel)(const PaletteSearch &search, const uint8_t *bgra, int count, uint8_t *indices);
+    ClosestKernel closestKernel;
+    RowKernel rowKernel;
+    const char *kernelName;
+
+    bool initializeChannels(uint8_t *palette);
+    void selectKernels();
+
+};
+
+#endif // PALETTESEARCH_HPP_INCLUDED
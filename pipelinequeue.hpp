@@ -0,0 +1,183 @@
+#ifndef PIPELINEQUEUE_HPP_INCLUDED
+#define PIPELINEQUEUE_HPP_INCLUDED
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <condition_variable>
+
+// Puts threads to sleep until another thread changes something they wait on, e.g. idle TaskPool workers. Waiters spin
+// briefly first, and notify only takes the mutex when somebody is asleep, so nothing locks while work keeps flowing.
+class ThreadParker {
+
+public:
+    ThreadParker() {
+        sleepers = 0;
+    }
+
+    template <typename Predicate>
+    void wait(Predicate isReady) {
+        if (!spin(isReady)) sleep(isReady);
+    }
+
+    // The two halves of wait, for callers that time them separately. spin returns whether isReady came true.
+    template <typename Predicate>
+    bool spin(Predicate isReady) {
+        for (int spins = 0; spins < 64; spins++) {
+            if (isReady()) return true;
+            std::this_thread::yield();
+        }
+        return false;
+    }
+    template <typename Predicate>
+    void sleep(Predicate isReady) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers++; // Before the last check, so a notify after it can't miss this thread
+        std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the one in notifyAll
+        condition.wait(lock, isReady);
+        sleepers--;
+    }
+
+    // Call after the change the waiters look for
+    void notifyAll() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load() == 0) return;
+        { std::lock_guard<std::mutex> lock(mutex); } // A waiter between its last check and sleeping holds this
+        condition.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<int> sleepers;
+
+};
+
+
+// Collects frames from several producers and hands them out strictly in frame order. Lock-free ring indexed by
+// frameNumber % capacity: a producer fills its frame's slot once the frame is less than capacity ahead of the next
+// frame to hand out. Nothing blocks on the consumer side. Whoever pushes the next frame sees isNextReady() and starts
+// a consumer task, which takes frames with tryPopNext until the next one is missing. Only one consumer may run at a time,
+// and the next one has to start after the last one stopped, e.g. through an atomic flag (see runWriteTask).
+template <typename T>
+class ReorderQueue {
+
+public:
+    ReorderQueue(size_t capacity, int firstFrameNumber) {
+        this->capacity = (capacity < 1) ? 1 : capacity;
+        slots = new Slot[this->capacity];
+        for (size_t i = 0; i < this->capacity; i++) {
+            slots[i].frameNumber.store(EMPTY_SLOT, std::memory_order_relaxed);
+        }
+        nextFrameNumber = firstFrameNumber;
+    }
+
+    ~ReorderQueue() {
+        delete[] slots;
+    }
+
+    // Waits while frameNumber is capacity or more frames ahead. A capacity covering every frame in flight never waits.
+    void push(int frameNumber, T item) {
+        auto isInWindow = [&]() { return frameNumber - nextFrameNumber.load(std::memory_order_acquire) < (long long) capacity; };
+        if (!isInWindow()) notFull.wait(isInWindow);
+        Slot & slot = slots[frameNumber % capacity];
+        slot.item = std::move(item);
+        slot.frameNumber.store(frameNumber, std::memory_order_release);
+    }
+
+    // Takes the next frame if it is here. Doesn't wait.
+    bool tryPopNext(T &item) {
+        int frameNumber = nextFrameNumber.load(std::memory_order_relaxed); // Only the consumer changes it
+        Slot & slot = slots[frameNumber % capacity];
+        if (slot.frameNumber.load(std::memory_order_acquire) != frameNumber) return false;
+        item = std::move(slot.item);
+        nextFrameNumber.store(frameNumber + 1, std::memory_order_release);
+        notFull.notifyAll(); // One waiting producer may now hold a frame inside the window
+        return true;
+    }
+
+    bool isNextReady() {
+        int frameNumber = nextFrameNumber.load(std::memory_order_acquire);
+        return slots[frameNumber % capacity].frameNumber.load(std::memory_order_acquire) == frameNumber;
+    }
+
+    // Frames waiting for the consumer. Only a snapshot while other threads are using the queue.
+    size_t size() {
+        int next = nextFrameNumber.load(std::memory_order_relaxed);
+        size_t count = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            if (slots[i].frameNumber.load(std::memory_order_relaxed) >= next) count++;
+        }
+        return count;
+    }
+
+private:
+    static const int EMPTY_SLOT = INT_MIN;
+
+    struct alignas(64) Slot {
+        std::atomic<int> frameNumber; // Frame held by the slot. Anything before nextFrameNumber was already consumed.
+        T item;
+    };
+
+    Slot * slots;
+    size_t capacity;
+    alignas(64) std::atomic<int> nextFrameNumber;
+    ThreadParker notFull;
+
+};
+
+
+// Holds frames from several producers until each has been paired with the frame after it, so frame n can be delta
+// encoded against frame n-1 by whichever producer finishes the second of the two, instead of by one serial consumer.
+// A frame is dropped once both pairs it belongs to are done(). The last frame stays until the FramePairs is destroyed.
+template <typename T>
+class FramePairs {
+
+public:
+    FramePairs(int firstFrameNumber) {
+        this->firstFrameNumber = firstFrameNumber;
+    }
+
+    // Stores the frame and fills ready with the frame numbers, in order, whose pair it completed: frameNumber if the frame
+    // before it is here (or it is the first frame), and frameNumber+1 if that one is already here. Returns the count.
+    int add(int frameNumber, T frame, int ready[2]) {
+        std::lock_guard<std::mutex> lock(mutex);
+        frames.emplace(frameNumber, Entry{std::move(frame), 2});
+        int count = 0;
+        if (frameNumber == firstFrameNumber || frames.count(frameNumber-1)) ready[count++] = frameNumber;
+        if (frames.count(frameNumber+1)) ready[count++] = frameNumber+1;
+        return count;
+    }
+
+    // Only valid for the frames of a pair add() returned, until that pair is done()
+    T & get(int frameNumber) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return frames.at(frameNumber).frame; // std::map never moves its elements
+    }
+
+    // The pair ending at frameNumber has been encoded
+    void done(int frameNumber) {
+        std::lock_guard<std::mutex> lock(mutex);
+        release(frameNumber);
+        if (frameNumber != firstFrameNumber) release(frameNumber-1);
+    }
+
+private:
+    struct Entry {
+        T frame;
+        int pairsLeft;
+    };
+
+    void release(int frameNumber) {
+        auto entry = frames.find(frameNumber);
+        if (--entry->second.pairsLeft == 0) frames.erase(entry);
+    }
+
+    std::mutex mutex;
+    std::map<int, Entry> frames;
+    int firstFrameNumber;
+
+};
+
+#endif // PIPELINEQUEUE_HPP_INCLUDED
@@ -0,0 +1,145 @@
+#include "pipelinestats.hpp"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static const char *stageNames[PipelineStats::STAGE_COUNT] = {"decode", "filter", "convert", "encode", "write"};
+
+PipelineStats::PipelineStats(int maxQueueDepth) : framesInFlight(max(maxQueueDepth, 0) + 1), framesWaiting(max(maxQueueDepth, 0) + 1) {
+    startTime = chrono::steady_clock::now();
+    isProgressStopping = false;
+}
+
+PipelineStats::~PipelineStats() {
+    stopProgress();
+}
+
+void PipelineStats::stageDone(Stage stage, chrono::steady_clock::time_point start, int items) {
+    long long nanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    stages[stage].count.fetch_add(items, memory_order_relaxed);
+    stages[stage].nanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+}
+
+void PipelineStats::record(vector<atomic<long long>> &histogram, int depth) {
+    histogram[min(max(depth, 0), (int) histogram.size() - 1)].fetch_add(1, memory_order_relaxed);
+}
+
+void PipelineStats::recordEncodedFrame(size_t bytes, int changed, int pixelCount) {
+    encodedFrames.fetch_add(1, memory_order_relaxed);
+    encodedBytes.fetch_add(bytes, memory_order_relaxed);
+    changedPixels.fetch_add(changed, memory_order_relaxed);
+    encodedPixels.fetch_add(pixelCount, memory_order_relaxed);
+    long long size = bytes;
+    long long smallest = minEncodedBytes.load(memory_order_relaxed);
+    while (size < smallest && !minEncodedBytes.compare_exchange_weak(smallest, size, memory_order_relaxed)) {}
+    long long largest = maxEncodedBytes.load(memory_order_relaxed);
+    while (size > largest && !maxEncodedBytes.compare_exchange_weak(largest, size, memory_order_relaxed)) {}
+}
+
+// Call once the pool has been shut down
+void PipelineStats::setWorkerTimes(const TaskPool &pool) {
+    workerTimes.clear();
+    for (int i = 0; i < pool.getWorkerCount(); i++) {
+        workerTimes.push_back(pool.getWorkerTimes(i));
+    }
+}
+
+void PipelineStats::startProgress(int expectedFrames) {
+    stopProgress();
+    isProgressStopping = false;
+    progressThread = thread(&PipelineStats::printProgress, this, expectedFrames);
+}
+
+void PipelineStats::stopProgress() {
+    if (!progressThread.joinable()) return;
+    {
+        lock_guard<mutex> lock(progressMutex);
+        isProgressStopping = true;
+    }
+    progressCondition.notify_all();
+    progressThread.join();
+    cout << endl;
+}
+
+// Frames are counted as they leave the convert stage, so both the single pipeline and segments move the line
+void PipelineStats::printProgress(int expectedFrames) {
+    auto progressStart = chrono::steady_clock::now();
+    auto lastTime = progressStart;
+    long long lastFrames = 0;
+    unique_lock<mutex> lock(progressMutex);
+    while (!progressCondition.wait_for(lock, chrono::seconds(1), [this]() { return isProgressStopping; })) {
+        auto now = chrono::steady_clock::now();
+        long long frames = stages[Convert].count.load(memory_order_relaxed);
+        double fps = (frames - lastFrames) / chrono::duration<double>(now - lastTime).count();
+        double averageFps = frames / chrono::duration<double>(now - progressStart).count();
+        lastFrames = frames;
+        lastTime = now;
+
+        ostringstream line; // Built first, so the line goes out in one piece and cout's formatting is left alone
+        line << "\rFrame " << frames;
+        if (expectedFrames > 0) line << "/" << expectedFrames << " (" << min(100LL, 100 * frames / expectedFrames) << "%)";
+        line << ", " << fixed << setprecision(1) << fps << " fps";
+        if (expectedFrames > 0 && averageFps > 0) {
+            int etaSeconds = max(0, (int) ((expectedFrames - frames) / averageFps));
+            line << ", ETA " << etaSeconds / 60 << ":" << setw(2) << setfill('0') << etaSeconds % 60;
+        }
+        line << "     "; // Clears what is left of a longer line
+        cout << line.str() << flush;
+    }
+}
+
+// JSON, so conversions of different inputs and settings can be compared by a script
+bool PipelineStats::writeReport(const string &fileName, int framesWritten) const {
+    ofstream out(fileName);
+    if (!out.is_open()) {
+        cerr << fileName << ": File could not be opened." << endl;
+        return false;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    long long frameCount = encodedFrames.load();
+
+    out << fixed << setprecision(6);
+    out << "{" << endl;
+    out << "  \"seconds\": " << seconds << "," << endl;
+    out << "  \"framesWritten\": " << framesWritten << "," << endl;
+    out << "  \"framesPerSecond\": " << framesWritten / seconds << "," << endl;
+    out << "  \"stages\": {" << endl;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        long long count = stages[stage].count.load();
+        double stageSeconds = stages[stage].nanoseconds.load() / 1e9;
+        out << "    \"" << stageNames[stage] << "\": {\"count\": " << count << ", \"seconds\": " << stageSeconds
+            << ", \"msPerItem\": " << (count > 0 ? 1000 * stageSeconds / count : 0) << "}" << (stage+1 < STAGE_COUNT ? "," : "") << endl;
+    }
+    out << "  }," << endl;
+
+    auto writeHistogram = [&out](const char *name, const vector<atomic<long long>> &histogram, bool isLast) {
+        out << "    \"" << name << "\": [";
+        for (size_t i = 0; i < histogram.size(); i++) {
+            out << (i > 0 ? ", " : "") << histogram[i].load();
+        }
+        out << "]" << (isLast ? "" : ",") << endl;
+    };
+    out << "  \"queueDepth\": {" << endl;
+    writeHistogram("framesInFlight", framesInFlight, false);
+    writeHistogram("framesWaitingToWrite", framesWaiting, true);
+    out << "  }," << endl;
+
+    out << "  \"workers\": [" << endl;
+    for (size_t i = 0; i < workerTimes.size(); i++) {
+        out << "    {\"busySeconds\": " << workerTimes[i].busyNanoseconds / 1e9 << ", \"spinSeconds\": " << workerTimes[i].spinNanoseconds / 1e9
+            << ", \"idleSeconds\": " << workerTimes[i].idleNanoseconds / 1e9 << "}" << (i+1 < workerTimes.size() ? "," : "") << endl;
+    }
+    out << "  ]," << endl;
+
+    out << "  \"encodedFrames\": {\"count\": " << frameCount;
+    if (frameCount > 0) {
+        out << ", \"meanBytes\": " << (double) encodedBytes.load() / frameCount << ", \"minBytes\": " << minEncodedBytes.load()
+            << ", \"maxBytes\": " << maxEncodedBytes.load() << ", \"changedPixelRatio\": " << (double) changedPixels.load() / encodedPixels.load();
+    }
+    out << "}" << endl;
+    out << "}" << endl;
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef PIPELINESTATS_HPP_INCLUDED
+#define PIPELINESTATS_HPP_INCLUDED
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "taskpool.hpp"
+
+// Counters and timers for every stage of a conversion, updated by any thread without locking. A few relaxed atomic adds
+// per frame and stage, so they are always on. Shown as a progress line while converting and written as JSON at the end.
+class PipelineStats {
+
+public:
+    // Filter is scaling and pixel format conversion, Convert is pixel mapping. Encode includes writing to the temp files
+    // in segmented mode, where Write is stitching them together.
+    enum Stage { Decode, Filter, Convert, Encode, Write, STAGE_COUNT };
+
+    // Queue depth histograms have a bin for every depth up to maxQueueDepth. Deeper samples go in the last one.
+    PipelineStats(int maxQueueDepth);
+    ~PipelineStats();
+
+    void stageDone(Stage stage, std::chrono::steady_clock::time_point start, int items = 1);
+    // Frames decoded but not written yet, sampled whenever a frame is decoded
+    void recordFramesInFlight(int frames) { record(framesInFlight, frames); }
+    // Encoded frames waiting for the ones before them to be written, sampled whenever a frame is encoded
+    void recordFramesWaiting(int frames) { record(framesWaiting, frames); }
+    // changedPixels as counted by the encoder, so every pixel of a keyframe
+    void recordEncodedFrame(size_t bytes, int changedPixels, int pixelCount);
+    void setWorkerTimes(const TaskPool &pool);
+    // For workers outside a TaskPool, such as the segment workers
+    void setWorkerTimes(const std::vector<TaskPool::WorkerTimes> &times) { workerTimes = times; }
+
+    long long getStageCount(Stage stage) const { return stages[stage].count; }
+    long long getStageNanoseconds(Stage stage) const { return stages[stage].nanoseconds; }
+
+    // Prints frames converted, fps and ETA on one line every second until stopProgress. expectedFrames <= 0 if unknown.
+    void startProgress(int expectedFrames);
+    void stopProgress();
+
+    bool writeReport(const std::string &fileName, int framesWritten) const;
+
+private:
+    struct StageCounters {
+        std::atomic<long long> count{0};
+        std::atomic<long long> nanoseconds{0};
+    };
+    StageCounters stages[STAGE_COUNT];
+    std::vector<std::atomic<long long>> framesInFlight;
+    std::vector<std::atomic<long long>> framesWaiting;
+    std::atomic<long long> encodedFrames{0};
+    std::atomic<long long> encodedBytes{0};
+    std::atomic<long long> minEncodedBytes{LLONG_MAX};
+    std::atomic<long long> maxEncodedBytes{0};
+    std::atomic<long long> changedPixels{0};
+    std::atomic<long long> encodedPixels{0};
+    std::vector<TaskPool::WorkerTimes> workerTimes;
+    std::chrono::steady_clock::time_point startTime;
+
+    std::thread progressThread;
+    std::mutex progressMutex;
+    std::condition_variable progressCondition;
+    bool isProgressStopping;
+
+    void record(std::vector<std::atomic<long long>> &histogram, int depth);
+    void printProgress(int expectedFrames);
+
+};
+
+#endif // PIPELINESTATS_HPP_INCLUDED
@@ -0,0 +1,117 @@
+#include "taskpool.hpp"
+#include <chrono>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+static thread_local int currentWorkerIndex = -1;
+
+TaskPool::TaskPool(int workerCount, bool pinThreads) {
+    if (workerCount < 1) workerCount = 1;
+    queuedTasks = 0;
+    nextQueue = 0;
+    stopping = false;
+    for (int i = 0; i < workerCount; i++) {
+        queues.emplace_back(new WorkerQueue());
+    }
+    int cpuCount = max((int) thread::hardware_concurrency(), 1);
+    for (int i = 0; i < workerCount; i++) {
+        workers.emplace_back(&TaskPool::runWorker, this, i);
+#ifdef __linux__
+        if (pinThreads) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cpuCount, &cpus);
+            pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpus), &cpus);
+        }
+#endif
+    }
+}
+
+TaskPool::~TaskPool() {
+    shutdown();
+}
+
+void TaskPool::submit(Task task) {
+    int index = (currentWorkerIndex >= 0) ? currentWorkerIndex : nextQueue++ % queues.size();
+    {
+        lock_guard<mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(move(task));
+    }
+    queuedTasks++;
+    workAvailable.notifyAll();
+}
+
+void TaskPool::shutdown() {
+    stopping = true;
+    workAvailable.notifyAll();
+    for (auto& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+}
+
+int TaskPool::currentWorker() {
+    return currentWorkerIndex;
+}
+
+TaskPool::WorkerTimes TaskPool::getWorkerTimes(int worker) const {
+    const WorkerQueue & queue = *queues[worker];
+    return {queue.busyNanoseconds.load(memory_order_relaxed), queue.spinNanoseconds.load(memory_order_relaxed),
+            queue.idleNanoseconds.load(memory_order_relaxed)};
+}
+
+static long long nanosecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+void TaskPool::runWorker(int index) {
+    currentWorkerIndex = index;
+    WorkerQueue & queue = *queues[index];
+    auto isWorkAvailable = [this]() { return stopping.load() || queuedTasks.load() > 0; };
+    Task task;
+    while (true) {
+        auto start = chrono::steady_clock::now();
+        if (takeTask(index, task)) {
+            task();
+            task = nullptr; // Free what it captured before sleeping
+            queue.busyNanoseconds.fetch_add(nanosecondsSince(start), memory_order_relaxed);
+            continue;
+        }
+        bool isReady = workAvailable.spin(isWorkAvailable);
+        queue.spinNanoseconds.fetch_add(nanosecondsSince(start), memory_order_relaxed);
+        if (!isReady) {
+            start = chrono::steady_clock::now();
+            workAvailable.sleep(isWorkAvailable);
+            queue.idleNanoseconds.fetch_add(nanosecondsSince(start), memory_order_relaxed);
+        }
+        if (stopping && queuedTasks == 0) return;
+    }
+}
+
+// Own queue newest first, then the other queues oldest first, starting with the next worker so thieves spread out
+bool TaskPool::takeTask(int index, Task &task) {
+    {
+        WorkerQueue & queue = *queues[index];
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+            queuedTasks--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkerQueue & queue = *queues[(index + i) % queues.size()];
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queuedTasks--;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,61 @@
+#ifndef TASKPOOL_HPP_INCLUDED
+#define TASKPOOL_HPP_INCLUDED
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pipelinequeue.hpp"
+
+// Fixed set of worker threads that run whatever task is runnable, instead of each thread owning one pipeline stage.
+// Every worker has its own deque of tasks: it takes the newest task it submitted itself (likely still in its cache),
+// and once that runs dry it steals the oldest task of another worker. Tasks submitted from outside the pool are dealt
+// out round-robin.
+class TaskPool {
+
+public:
+    typedef std::function<void()> Task;
+
+    // pinThreads puts worker i on CPU i (Linux only), so workers don't migrate and take their caches with them
+    TaskPool(int workerCount, bool pinThreads);
+    ~TaskPool();
+
+    void submit(Task task);
+    // Lets the workers finish every queued task, then joins them. Must not be called from a task.
+    void shutdown();
+
+    int getWorkerCount() const { return workers.size(); }
+    // Where a worker's time went so far: running tasks, spinning for work, or asleep
+    struct WorkerTimes {
+        long long busyNanoseconds;
+        long long spinNanoseconds;
+        long long idleNanoseconds;
+    };
+    WorkerTimes getWorkerTimes(int worker) const;
+    // Index of the worker running the calling thread, or -1 outside the pool. For per-worker state.
+    static int currentWorker();
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        // Only written by the worker itself
+        std::atomic<long long> busyNanoseconds{0};
+        std::atomic<long long> spinNanoseconds{0};
+        std::atomic<long long> idleNanoseconds{0};
+    };
+
+    void runWorker(int index);
+    bool takeTask(int index, Task &task);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queuedTasks;
+    std::atomic<unsigned> nextQueue; // For tasks submitted from outside
+    std::atomic<bool> stopping;
+    ThreadParker workAvailable;
+
+};
+
+#endif // TASKPOOL_HPP_INCLUDED
@@ -0,0 +1,138 @@
+#include "thresholdmap.hpp"
+#include <cmath>
+#include <random>
+#include <algorithm>
+
+using namespace std;
+
+ThresholdMap::ThresholdMap(int size, const vector<int> &ranks) {
+    this->size = size;
+    int cellCount = size * size;
+    offsets.resize(cellCount);
+    for (int i = 0; i < cellCount; i++) {
+        offsets[i] = (int8_t) floor(((ranks[i] + 0.5) / cellCount - 0.5) * DITHER_STRENGTH);
+    }
+}
+
+// Bayer matrices are built recursively: every cell of the n/2 matrix becomes a 2x2 block of the n matrix.
+static vector<int> bayerRanks(int size) {
+    vector<int> ranks(1, 0);
+    for (int n = 2; n <= size; n *= 2) {
+        vector<int> next(n * n);
+        int half = n / 2;
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                static const int quadrant[2][2] = { {0, 2}, {3, 1} };
+                next[y*n + x] = 4 * ranks[(y % half)*half + (x % half)] + quadrant[y / half][x / half];
+            }
+        }
+        ranks = move(next);
+    }
+    return ranks;
+}
+
+/*
+    Void-and-cluster (Ulichney, 1993). Every cell has an energy: the sum of a gaussian of its wrapped distance to every
+    set cell. The set cell with the highest energy is the tightest cluster, the empty cell with the lowest is the largest
+    void. Starting from a random pattern, clusters are moved into voids until that stops changing anything. Cells are
+    then ranked by removing clusters from that pattern one by one, and by filling voids until the map is full.
+*/
+class VoidAndCluster {
+
+public:
+    VoidAndCluster(int size) {
+        this->size = size;
+        kernel.resize(size * size);
+        energy.assign(size * size, 0);
+        isSet.assign(size * size, false);
+        const double sigma = 1.5;
+        for (int dy = 0; dy < size; dy++) {
+            for (int dx = 0; dx < size; dx++) {
+                int wrappedX = min(dx, size - dx);
+                int wrappedY = min(dy, size - dy);
+                kernel[dy*size + dx] = exp(-(wrappedX*wrappedX + wrappedY*wrappedY) / (2 * sigma * sigma));
+            }
+        }
+    }
+
+    void set(int cell, bool value) {
+        isSet[cell] = value;
+        double sign = value ? 1 : -1;
+        int cellX = cell % size;
+        int cellY = cell / size;
+        for (int y = 0; y < size; y++) {
+            const double *kernelRow = kernel.data() + ((y - cellY + size) % size) * size;
+            double *energyRow = energy.data() + y * size;
+            for (int x = 0; x < size; x++) {
+                energyRow[x] += sign * kernelRow[(x - cellX + size) % size];
+            }
+        }
+    }
+
+    int tightestCluster() const { return extreme(true); }
+    int largestVoid() const { return extreme(false); }
+
+    vector<bool> isSet;
+
+private:
+    int size;
+    vector<double> kernel;
+    vector<double> energy;
+
+    // Highest energy set cell, or lowest energy empty cell
+    int extreme(bool ofSet) const {
+        int best = -1;
+        for (int i = 0; i < size * size; i++) {
+            if (isSet[i] != ofSet) continue;
+            if (best < 0 || (ofSet ? energy[i] > energy[best] : energy[i] < energy[best])) best = i;
+        }
+        return best;
+    }
+
+};
+
+static vector<int> blueNoiseRanks(int size) {
+    int cellCount = size * size;
+    int initialCount = cellCount / 10;
+
+    VoidAndCluster pattern(size);
+    mt19937 random(1); // Fixed seed, so every run (and every frame) uses the same map
+    for (int placed = 0; placed < initialCount; ) {
+        int cell = random() % cellCount;
+        if (!pattern.isSet[cell]) {
+            pattern.set(cell, true);
+            placed++;
+        }
+    }
+    for (int i = 0; i < cellCount; i++) { // Converges long before this
+        int cluster = pattern.tightestCluster();
+        pattern.set(cluster, false);
+        int largestVoid = pattern.largestVoid();
+        pattern.set(largestVoid, true);
+        if (largestVoid == cluster) break;
+    }
+
+    vector<int> ranks(cellCount);
+    VoidAndCluster removal = pattern;
+    for (int rank = initialCount - 1; rank >= 0; rank--) {
+        int cluster = removal.tightestCluster();
+        removal.set(cluster, false);
+        ranks[cluster] = rank;
+    }
+    for (int rank = initialCount; rank < cellCount; rank++) {
+        int largestVoid = pattern.largestVoid();
+        pattern.set(largestVoid, true);
+        ranks[largestVoid] = rank;
+    }
+    return ranks;
+}
+
+const ThresholdMap & ThresholdMap::bayer() {
+    static const ThresholdMap map(8, bayerRanks(8));
+    return map;
+}
+
+const ThresholdMap & ThresholdMap::blueNoise() {
+    static const ThresholdMap map(64, blueNoiseRanks(64)); // Thread-safe, so converters can all ask for it at once
+    return map;
+}
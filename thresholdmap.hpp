@@ -0,0 +1,33 @@
+#ifndef THRESHOLDMAP_HPP_INCLUDED
+#define THRESHOLDMAP_HPP_INCLUDED
+#include <cstdint>
+#include <vector>
+
+// Tileable threshold map for ordered dithering. Every pixel gets a fixed offset depending only on its position, so a
+// pixel whose color doesn't change maps to the same palette index in every frame, no matter what happens around it.
+// Offsets are added to all three channels before the palette search.
+class ThresholdMap {
+
+public:
+    // 8x8 Bayer matrix. Cheap and regular, but its cross-hatch pattern is visible.
+    static const ThresholdMap & bayer();
+    // 64x64 blue noise made with the void-and-cluster method. Built on first use, which takes a few milliseconds.
+    static const ThresholdMap & blueNoise();
+
+    // Offsets for row y, repeated every getSize() pixels
+    const int8_t * row(int y) const { return offsets.data() + (y & (size-1)) * size; }
+    int getSize() const { return size; }
+
+    // Offsets span [-DITHER_STRENGTH/2, DITHER_STRENGTH/2). About the distance between neighboring expanded palette colors.
+    static const int DITHER_STRENGTH = 32;
+
+private:
+    // ranks holds every value in [0, size*size) once
+    ThresholdMap(int size, const std::vector<int> &ranks);
+
+    int size; // Power of 2
+    std::vector<int8_t> offsets;
+
+};
+
+#endif // THRESHOLDMAP_HPP_INCLUDED
@@ -1,3 +1,3 @@
-g++ main.cpp fastpixelmap.cpp decodevideo.cpp -lavutil -lavformat -lavcodec -lavfilter -lm -lz -lswscale -pthread -O2
+g++ main.cpp fastpixelmap.cpp decodevideo.cpp colorlut.cpp palettesearch.cpp framepool.cpp gameimage.cpp thresholdmap.cpp frameindex.cpp taskpool.cpp benchmark.cpp pipelinestats.cpp -lavutil -lavformat -lavcodec -lavfilter -lm -lz -lswscale -pthread -O2
 mv a.out videoConverter
 sudo mv videoConverter /usr/bin/